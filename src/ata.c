@@ -0,0 +1,196 @@
+/*
+ *      ata.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+/*
+ * ATA disk driver
+ *
+ * A minimal driver for the master disk on the primary ATA channel, which is the
+ * disk qemu provides with -hda. Transfers use programmed I/O and 28-bit LBA
+ * addressing. The driver polls the status register until the disk is ready, and
+ * disk interrupts are disabled. This is slow, because the CPU does nothing else
+ * while a transfer is in progress. However it is simple, and the disk is only
+ * used for swap (see swap.c), where the process that needs a page has to wait
+ * for it anyway.
+ */
+
+#define ATA_DATA             0x1F0
+#define ATA_SECTOR_COUNT     0x1F2
+#define ATA_LBA_LOW          0x1F3
+#define ATA_LBA_MID          0x1F4
+#define ATA_LBA_HIGH         0x1F5
+#define ATA_DRIVE            0x1F6
+#define ATA_STATUS           0x1F7	/* when read */
+#define ATA_COMMAND          0x1F7	/* when written */
+#define ATA_CONTROL          0x3F6	/* alternate status when read */
+
+#define ATA_STATUS_ERR       0x01
+#define ATA_STATUS_DRQ       0x08	/* ready to transfer data */
+#define ATA_STATUS_DF        0x20	/* drive fault */
+#define ATA_STATUS_BSY       0x80
+
+#define ATA_CONTROL_NIEN     0x02	/* disable interrupts */
+#define ATA_DRIVE_MASTER     0xA0
+#define ATA_DRIVE_LBA        0x40
+
+#define ATA_CMD_READ         0x20
+#define ATA_CMD_WRITE        0x30
+#define ATA_CMD_IDENTIFY     0xEC
+
+#define ATA_TIMEOUT          1000000	/* status polls before giving up */
+
+/*
+ * Number of sectors on the disk, or 0 if there is no usable disk
+ */
+static unsigned int ata_sectors = 0;
+
+/*
+ * ata_delay
+ *
+ * Give the disk time to update its status after a command or a change of drive.
+ * Each read of the alternate status register takes around 100ns.
+ */
+static void ata_delay(void)
+{
+	inb(ATA_CONTROL);
+	inb(ATA_CONTROL);
+	inb(ATA_CONTROL);
+	inb(ATA_CONTROL);
+}
+
+/*
+ * ata_wait
+ *
+ * Wait until the disk is no longer busy and, if drq is set, until it is ready to
+ * transfer data. Returns 0 if it is ready, or -EIO if it reports an error or does
+ * not respond.
+ */
+static int ata_wait(int drq)
+{
+	unsigned int i;
+	for (i = 0; i < ATA_TIMEOUT; i++) {
+		unsigned char status = inb(ATA_STATUS);
+		if (status & ATA_STATUS_BSY)
+			continue;
+		if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+			return -EIO;
+		if (!drq || (status & ATA_STATUS_DRQ))
+			return 0;
+	}
+	return -EIO;
+}
+
+/*
+ * ata_command
+ *
+ * Issue a read or write command for count sectors starting at lba
+ */
+static int ata_command(unsigned int lba, unsigned int count, unsigned int cmd)
+{
+	if (0 != ata_wait(0))
+		return -EIO;
+	outb(ATA_DRIVE, ATA_DRIVE_MASTER | ATA_DRIVE_LBA | ((lba >> 24) & 0x0F));
+	ata_delay();
+	outb(ATA_SECTOR_COUNT, count);
+	outb(ATA_LBA_LOW, lba & 0xFF);
+	outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+	outb(ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+	outb(ATA_COMMAND, cmd);
+	ata_delay();
+	return 0;
+}
+
+/*
+ * ata_init
+ *
+ * Look for a disk, using the IDENTIFY command. Returns the number of sectors on
+ * it, or 0 if there is no disk, or the device is not an ATA disk (e.g. it is a
+ * CD-ROM drive).
+ */
+unsigned int ata_init(void)
+{
+	unsigned short id[ATA_SECTOR_SIZE / 2];
+
+	if (0xFF == inb(ATA_STATUS))	/* floating bus: no controller */
+		return 0;
+	outb(ATA_CONTROL, ATA_CONTROL_NIEN);
+	outb(ATA_DRIVE, ATA_DRIVE_MASTER);
+	ata_delay();
+	outb(ATA_SECTOR_COUNT, 0);
+	outb(ATA_LBA_LOW, 0);
+	outb(ATA_LBA_MID, 0);
+	outb(ATA_LBA_HIGH, 0);
+	outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+	ata_delay();
+	if (0 == inb(ATA_STATUS))	/* no drive */
+		return 0;
+
+	/*
+	 * ATAPI devices abort IDENTIFY and put their signature in the LBA
+	 * registers, which are otherwise left as 0
+	 */
+	if ((0 != ata_wait(0)) || (0 != inb(ATA_LBA_MID)) ||
+	    (0 != inb(ATA_LBA_HIGH)) || (0 != ata_wait(1)))
+		return 0;
+
+	insw(ATA_DATA, id, ATA_SECTOR_SIZE / 2);
+	ata_sectors = id[60] | (id[61] << 16);	/* LBA28 sector count */
+	return ata_sectors;
+}
+
+/*
+ * ata_read
+ *
+ * Read count sectors from the disk, starting at sector lba. Returns 0 on
+ * success, -EINVAL if the sectors are not on the disk, or -EIO if the transfer
+ * failed.
+ */
+int ata_read(unsigned int lba, unsigned int count, void *buf)
+{
+	unsigned short *words = (unsigned short *)buf;
+	unsigned int i;
+
+	if ((0 == count) || (256 < count) || (lba + count > ata_sectors) ||
+	    (lba + count < lba))
+		return -EINVAL;
+	if (0 != ata_command(lba, count % 256, ATA_CMD_READ))
+		return -EIO;
+	for (i = 0; i < count; i++) {
+		if (0 != ata_wait(1))
+			return -EIO;
+		insw(ATA_DATA, words, ATA_SECTOR_SIZE / 2);
+		words += ATA_SECTOR_SIZE / 2;
+	}
+	return 0;
+}
+
+/*
+ * ata_write
+ *
+ * Write count sectors to the disk, starting at sector lba. The data may still be
+ * in the disk's write cache when this returns, which is fine for swap, since it
+ * never needs to survive a reboot. Returns 0 on success, -EINVAL if the sectors
+ * are not on the disk, or -EIO if the transfer failed.
+ */
+int ata_write(unsigned int lba, unsigned int count, const void *buf)
+{
+	const unsigned short *words = (const unsigned short *)buf;
+	unsigned int i;
+
+	if ((0 == count) || (256 < count) || (lba + count > ata_sectors) ||
+	    (lba + count < lba))
+		return -EINVAL;
+	if (0 != ata_command(lba, count % 256, ATA_CMD_WRITE))
+		return -EIO;
+	for (i = 0; i < count; i++) {
+		if (0 != ata_wait(1))
+			return -EIO;
+		outsw(ATA_DATA, words, ATA_SECTOR_SIZE / 2);
+		words += ATA_SECTOR_SIZE / 2;
+	}
+	return ata_wait(0);
+}
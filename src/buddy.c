@@ -20,28 +20,25 @@ void kprintf(const char *format, ...);
 #define set_sizem(_b,_s) ma->blocks[(_b)/(1 << ma->lower)].sizem = (_s)
 #define set_used(_b,_u)  ma->blocks[(_b)/(1 << ma->lower)].used = (_u)
 
-/* Minimum granularity for keeping track of blocks. 
- * This affects the size of the blocks array in the memarea structure. See
- * the description of buddy_init for further details. Note that this must
- * be at least 2 (i.e. 2^2 = 4 bytes),since we store 4 byte pointers in
- * unused blocks for the free list links.  
- */
-#define DEFAULT_LOWER 8		/* 256 bytes */
+/* Helper macros for accessing the free list links stored in unused blocks */
+#define next_free(_b)    (((unsigned int *)(ma->mem + (_b)))[0])
+#define prev_free(_b)    (((unsigned int *)(ma->mem + (_b)))[1])
 
 /* mforsize - measure for the block size
  * 
  * Determine the actual block size to be used for a particular requested size. This
  * is called when the buddy allocator receives a new allocation request, in order
- * to figure out how much memory to actually allocate. The block size must be a
- * power of 2, and at least as big as the smallest level of granularity, which is
- * 256 bytes. This function returns the base-2 log of the size, i.e. a value k
+ * to figure out how much memory to actually allocate. The block size is the
+ * smallest power of 2 that holds nbytes, and at least as big as the smallest
+ * level of granularity, which is 256 bytes. A request that is already a power of
+ * 2, such as a slab or a page, therefore fits its block exactly. This function returns the base-2 log of the size, i.e. a value k
  * such that 2^k = blocksize.
  */
 static unsigned int mforsize(memarea * ma, unsigned int nbytes)
 {
 	unsigned int pow2;
 	unsigned int m = 0;
-	for (pow2 = 1; pow2 <= nbytes; pow2 *= 2)
+	for (pow2 = 1; pow2 < nbytes; pow2 *= 2)
 		m++;
 	return (m >= ma->lower) ? m : ma->lower;
 }
@@ -70,35 +67,60 @@ static unsigned int get_buddy(memarea * ma, unsigned int block)
  * maintains separate free lists for each size, and the blocks in each free list
  * are of the corresponding size. This enables a free block of a particular size to
  * be obtained quickly by just removing the first element from the list.
+ * 
+ * The lists are doubly linked, with the next and previous offsets stored in the
+ * first two words of each free block. The freemask field records which of the
+ * lists are non-empty.
  */
 static void add_to_freelist(memarea * ma, unsigned int m, unsigned int block)
 {
 	assert(block + (1 << m) <= (1 << ma->upper));
-	*(unsigned int *)(ma->mem + block) = ma->freelist[m];
+	next_free(block) = ma->freelist[m];
+	prev_free(block) = EMPTY;
+	if (EMPTY != ma->freelist[m])
+		prev_free(ma->freelist[m]) = block;
 	ma->freelist[m] = block;
+	ma->freemask |= (1 << m);
 }
 
 /* remove_from_freelist
  * 
  * Remove the specified block from the free list of a particular size. This
  * function must only be called for blocks that definitely exist in the specified
- * free list.
+ * free list. Since the lists are doubly linked, this takes constant time
+ * regardless of how many other blocks are on the list.
  */
 static void
 remove_from_freelist(memarea * ma, unsigned int m, unsigned int block)
 {
-	int found = 0;
-	unsigned int *ptr = &ma->freelist[m];
-	while (EMPTY != *ptr) {
-		if (*ptr == block) {
-			*ptr = *(unsigned int *)(ma->mem + *ptr);
-			found = 1;
-			break;
-		} else {
-			ptr = (unsigned int *)(ma->mem + *ptr);
-		}
+	assert(!is_used(block));
+	assert(get_sizem(block) == m);
+	unsigned int next = next_free(block);
+	unsigned int prev = prev_free(block);
+	if (EMPTY == prev) {
+		assert(ma->freelist[m] == block);
+		ma->freelist[m] = next;
+	} else {
+		next_free(prev) = next;
 	}
-	assert(found);
+	if (EMPTY != next)
+		prev_free(next) = prev;
+	if (EMPTY == ma->freelist[m])
+		ma->freemask &= ~(1 << m);
+}
+
+/* first_free_order
+ * 
+ * Find the smallest block size greater than 2^m for which there is a free block,
+ * using a single bit scan of the freemask field. Returns a value greater than
+ * ma->upper if there is no such block.
+ */
+static unsigned int first_free_order(memarea * ma, unsigned int m)
+{
+	unsigned int mask = (m + 1 < 32) ? ma->freemask & ~((2 << m) - 1) : 0;
+	if (0 == mask)
+		return ma->upper + 1;
+	return __builtin_ctz(mask);
 }
 
 /*! buddy_alloc
@@ -106,9 +128,9 @@ remove_from_freelist(memarea * ma, unsigned int m, unsigned int block)
  * Allocate a block of a certain size within the requested memory area. This first
  * rounds up the size to the nearest power of two, and then searches the
  * appropriate free list to see if there any available blocks of that size. If
- * there aren't, it looks at the free lists successfully larger block sizes until
- * it finds a free block. This block is then split repeatedly until a block of the
- * required size is obtained.
+ * there aren't, it uses the freemask bitmap to find the smallest larger block
+ * size that has a free block. This block is then split repeatedly until a block
+ * of the required size is obtained.
  * 
  * The memory returned by this function is always within the range associated with
  * the memarea structure, which ranges from ma->mem to ma->mem + 2^ma->upper.
@@ -131,18 +153,9 @@ void *buddy_alloc(memarea * ma, unsigned int nbytes)
 		/*
 		 * Find the first free block of size > 2^m 
 		 */
-		int cm;
-		for (cm = m + 1; cm <= ma->upper; cm++) {
-			if (EMPTY != ma->freelist[cm])
-				break;
-		}
-		if (cm > ma->upper) {
-			kprintf("Memory exhausted\n");
-#ifndef USERLAND
-			assert(0);
-#endif				/* USERLAND */
+		unsigned int cm = first_free_order(ma, m);
+		if (cm > ma->upper)
 			return NULL;
-		}
 
 		/*
 		 * We found a free block; keep splitting it in two until we have a block
@@ -153,8 +166,6 @@ void *buddy_alloc(memarea * ma, unsigned int nbytes)
 			 * Remove block from free list 
 			 */
 			unsigned int block = ma->freelist[cm];
-			assert(!is_used(block));
-			assert(get_sizem(block) == cm);
 			remove_from_freelist(ma, cm, block);
 
 			/*
@@ -180,12 +191,10 @@ void *buddy_alloc(memarea * ma, unsigned int nbytes)
 	 */
 	unsigned int block = ma->freelist[m];
 	assert(EMPTY != block);
-	assert(!is_used(block));
-	assert(get_sizem(block) == m);
-	set_used(block, 1);
 	remove_from_freelist(ma, m, block);
+	set_used(block, 1);
 
-	return (void *)(block + (unsigned int)ma->mem);
+	return ma->mem + block;
 }
 
 /* buddy_free
@@ -253,6 +262,99 @@ void buddy_free(memarea * ma, void *ptr)
 	add_to_freelist(ma, m, block);
 }
 
+/* buddy_realloc
+ * 
+ * Change the size of a block previously allocated by buddy_alloc, returning a
+ * pointer to the resized block. The contents are preserved up to the smaller of
+ * the old and new sizes.
+ * 
+ * Copying is avoided wherever possible. A block is shrunk by splitting off its
+ * upper halves and putting them on the free lists. A block is grown in place if
+ * it is the lower half of each of the larger blocks it would become, and the
+ * upper halves are all free and unsplit; these are simply taken off the free
+ * lists and merged in. Only if that is not possible is a new block allocated and
+ * the data copied into it. In this case NULL is returned if there is not enough
+ * memory, and the original block is left untouched.
+ */
+void *buddy_realloc(memarea * ma, void *ptr, unsigned int nbytes)
+{
+	if (NULL == ptr)
+		return buddy_alloc(ma, nbytes);
+
+	if (0 == nbytes) {
+		buddy_free(ma, ptr);
+		return NULL;
+	}
+
+	assert(((char *)ptr >= ma->mem)
+	       && (char *)ptr < ma->mem + (1 << ma->upper));
+
+	unsigned int block = ((char *)ptr) - ma->mem;
+	unsigned int m = get_sizem(block);
+	unsigned int newm = mforsize(ma, nbytes);
+	assert((ma->lower <= m) && (ma->upper >= m));
+	assert(is_used(block));
+
+	/*
+	 * Shrink the block by repeatedly splitting it in two and freeing the upper
+	 * half. The upper half's buddy is the block we're keeping, so it can't
+	 * coalesce with anything. 
+	 */
+	if (newm < m) {
+		for (; m > newm; m--) {
+			unsigned int half2 = block + (1 << (m - 1));
+			set_sizem(block, m - 1);
+			set_sizem(half2, m - 1);
+			set_used(half2, 0);
+			add_to_freelist(ma, m - 1, half2);
+		}
+		return ptr;
+	}
+
+	/*
+	 * Check whether the block can be grown in place 
+	 */
+	unsigned int cm;
+	for (cm = m; cm < newm; cm++) {
+		unsigned int buddy = block + (1 << cm);
+		if ((cm >= ma->upper) || (block & (1 << cm)) ||
+		    is_used(buddy) || (get_sizem(buddy) != cm))
+			break;
+	}
+
+	if (cm == newm) {
+		for (cm = m; cm < newm; cm++) {
+			unsigned int buddy = block + (1 << cm);
+			remove_from_freelist(ma, cm, buddy);
+			set_sizem(buddy, 0);
+		}
+		set_sizem(block, newm);
+		return ptr;
+	}
+
+	/*
+	 * The block has to move 
+	 */
+	void *newptr = buddy_alloc(ma, nbytes);
+	if (NULL == newptr)
+		return NULL;
+	memmove(newptr, ptr, 1 << m);
+	buddy_free(ma, ptr);
+	return newptr;
+}
+
+/* buddy_size
+ * 
+ * Return the size of the block that was allocated for a pointer returned by
+ * buddy_alloc. This may be larger than the amount originally requested.
+ */
+unsigned int buddy_size(memarea * ma, void *ptr)
+{
+	unsigned int block = ((char *)ptr) - ma->mem;
+	assert(is_used(block));
+	return (1 << get_sizem(block));
+}
+
 /* buddy_nblocks
  * 
  * Compute the number of blockinfo structures necessary to keep track of a region
@@ -295,46 +397,180 @@ void buddy_init(memarea * ma, unsigned int sizepow2, char *membase,
 	memset(ma->blocks, 0, nblocks * sizeof(blockinfo));
 	memset(ma->freelist, 0xFF, 32 * sizeof(unsigned int));
 	ma->blocks[0].sizem = ma->upper;
-	ma->freelist[ma->upper] = 0;
-	*(unsigned int *)(ma->mem + 0) = EMPTY;
+	add_to_freelist(ma, ma->upper, 0);
+}
+
+/* buddy_grow
+ * 
+ * Enlarge the region of memory managed by a memarea structure to 2^sizepow2
+ * bytes, by repeatedly doubling the size of the top-level block. The memory
+ * following the existing region must already be available, and the blocks array
+ * passed to buddy_init must be large enough for the new size.
+ * 
+ * Each doubling adds a free block the same size as the existing region, which is
+ * merged with the existing region if that is entirely free. Blocks that have
+ * already been allocated are unaffected.
+ */
+void buddy_grow(memarea * ma, unsigned int sizepow2)
+{
+	while (ma->upper < sizepow2) {
+		unsigned int m = ma->upper;
+		unsigned int half2 = (1 << m);
+		memset(&ma->blocks[half2 >> ma->lower], 0,
+		       (half2 >> ma->lower) * sizeof(blockinfo));
+		ma->upper = m + 1;
+
+		if (!is_used(0) && (get_sizem(0) == m)) {
+			remove_from_freelist(ma, m, 0);
+			set_sizem(0, m + 1);
+			add_to_freelist(ma, m + 1, 0);
+		} else {
+			set_sizem(half2, m);
+			add_to_freelist(ma, m, half2);
+		}
+	}
 }
 
 #ifndef USERLAND
+/*
+ * The user heap starts out at 2^HEAP_INITIAL_SIZEPOW2 bytes, and is doubled
+ * whenever malloc or realloc can't find a large enough free block, up to a limit
+ * of 2^HEAP_MAX_SIZEPOW2 bytes. This is a limit of the allocator rather than the
+ * kernel: the data segment also holds the bookkeeping in front of the heap, and
+ * brk only stops it from running into the next area or the stack. Requests too
+ * large to be worth keeping in the heap are given mappings of their own instead
+ * (see mmap_alloc below).
+ */
+#define HEAP_INITIAL_SIZEPOW2 16	/* 64Kb */
+#define HEAP_MAX_SIZEPOW2     22	/* 4Mb */
+#define HEAP_MAX_PAGES        ((1 << HEAP_MAX_SIZEPOW2) / PAGE_SIZE)
+
+/*
+ * Small allocations
+ * 
+ * Most requests made by user programs are small, and the buddy allocator would
+ * round each of them up to at least 256 bytes, as well as splitting and
+ * coalescing blocks on every call. Requests of up to SMALL_MAX bytes are instead
+ * rounded up to a multiple of SMALL_MIN, and served from a separate free list
+ * for each of these size classes.
+ * 
+ * Each size class obtains whole pages from the buddy allocator, and carves them
+ * up into objects of that size; a page is only used for one size class at a
+ * time. The objects on a page are kept on the page's own free list, linked by
+ * the page offset of the next free object, which is stored in the first two
+ * bytes of each free object. The pages of a size class that have free objects
+ * are in turn kept on a doubly linked list, so that both malloc and free take
+ * constant time. Once every object on a page has been freed, the page is handed
+ * back to the buddy allocator, unless the size class has no other empty pages.
+ * 
+ * The bookkeeping data for each page is kept in the pages array of the heap's
+ * mallocstate structure, rather than in the page itself, so that objects which
+ * are a power of two in size fit exactly.
+ */
+#define SMALL_MIN             8
+#define SMALL_MAX             256
+#define SMALL_CLASSES         (SMALL_MAX / SMALL_MIN)
+#define SMALL_MAX_EMPTY       1
+#define NO_PAGE               0xFFFF
+#define NO_OBJECT             0xFFFF
+
+#define small_class(_n)       ((_n) ? ((_n) - 1) / SMALL_MIN : 0)
+#define small_page(_h,_p)     (((char *)(_p) - (_h)->ma.mem) / PAGE_SIZE)
+#define small_base(_h,_pg)    ((_h)->ma.mem + (_pg) * PAGE_SIZE)
+#define small_link(_o)        (*(unsigned short *)(_o))
+
+typedef struct smallpage {
+	unsigned short next;	/* pages in the same size class with free objects */
+	unsigned short prev;
+	unsigned short free;	/* offset of first free object, or NO_OBJECT */
+	unsigned short inuse;	/* number of objects allocated */
+	unsigned char class;	/* size class + 1, or 0 if not used for small objects */
+} smallpage;
+
+typedef struct smallclass {
+	unsigned short first;	/* first page with free objects, or NO_PAGE */
+	unsigned short nempty;	/* number of pages with no objects allocated */
+} smallclass;
+
+/*
+ * Bookkeeping data for the heap, which is placed at the start of the data
+ * segment. The memarea structure must come first, since other code finds it at
+ * PROCESS_DATA_BASE.
+ */
+typedef struct mallocstate {
+	memarea ma;
+	smallclass classes[SMALL_CLASSES];
+	smallpage pages[HEAP_MAX_PAGES];
+} mallocstate;
+
+#define user_heap             ((mallocstate *) PROCESS_DATA_BASE)
+
+/*
+ * Large allocations
+ * 
+ * Requests larger than MMAP_THRESHOLD bytes bypass the heap altogether, and are
+ * given their own anonymous mapping, so that free can hand the memory straight
+ * back to the kernel with munmap, and so that they are not limited by the
+ * maximum size of the heap. The size of the mapping is kept in a header of
+ * MMAP_HEADER bytes just before the block. Such blocks can be recognised by
+ * their address, since the mmap region lies above the data segment.
+ */
+#define MMAP_THRESHOLD        (128*KB)
+#define MMAP_HEADER           16
+#define is_mmapped(_p)        ((unsigned int)(_p) >= PROCESS_MMAP_BASE)
+#define mmap_size(_p)         (*(size_t *)((char *)(_p) - MMAP_HEADER))
+
+/* mmap_alloc
+ * 
+ * Allocate a large block in a mapping of its own. Returns NULL if the kernel
+ * could not provide the memory.
+ */
+static void *mmap_alloc(unsigned int nbytes)
+{
+	size_t len = nbytes + MMAP_HEADER;
+	char *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mem)
+		return NULL;
+	*(size_t *)mem = len;
+	return mem + MMAP_HEADER;
+}
+
 /* init_userspace_malloc - maintain the connections that malloc depends on.
  * 
- * Sets up the data segment of a process for use by malloc. The initial size of
- * the heap is specified here as a power of two, such that if this value is k then
- * the total heap size is 2^k. The data segment needs to hold this much memory,
- * plus some additional memory for the bookkepping data required by the buddy
- * allocation algorithm. This consists of a memarea structure, which is a fixed
- * size, as well as an array of blockinfo objects, which is a variable size based
- * on the size of the heap.
+ * Sets up the data segment of a process for use by malloc. The data segment
+ * holds the heap, plus some additional memory for the bookkepping data required
+ * by the allocator. This consists of a mallocstate structure (which includes the
+ * memarea structure used by the buddy allocation algorithm), which is a fixed
+ * size, as well as an array of blockinfo objects, whose size depends on the size
+ * of the heap.
+ * 
+ * The mallocstate structure and the blockinfo array are placed at the start of
+ * the data segment, and the heap follows them, starting at the next page
+ * boundary. The blockinfo array is made large enough for the maximum heap size,
+ * so that the heap can later be grown just by moving the end of the data
+ * segment.
  * 
  * The brk system call is used by the process to request that the kernel modify
- * the end of the process's data segment to the specified address. This address is
- * calculated by taking the start of the data segment, and adding the total amount
- * of memory required for the heap as well as the bookkeeping data. Once this
- * memory has been obtained by the process, it can calculate the address of its
- * memarea structure and the blockinfo array, which are placed directly after the
- * heap. These are passed to buddy_init to set up the bookkeeping data so that
- * subsequent calls to buddy_alloc and buddy_free (called by malloc and free,
- * respectively) will work.
+ * the end of the process's data segment to the specified address. Initially this
+ * is set to cover the bookkeeping data and a heap of 2^HEAP_INITIAL_SIZEPOW2
+ * bytes; grow_userspace_heap extends it further when needed.
  * 
  * This function must be called at process startup, before main begins.
  */
 void init_userspace_malloc()
 {
 	/*
-	 * Calculate the heap size in bytes, as well as the amount of memory required
-	 * for bookkeeping purposes 
+	 * Calculate the amount of memory required for bookkeeping purposes, and
+	 * the initial end of the data segment 
 	 */
-	unsigned int heap_sizep2 = 20;	/* 1Mb */
-	unsigned int heap_size = (1 << heap_sizep2);
-	unsigned int memarea_size = sizeof(memarea);
+	unsigned int state_size = sizeof(mallocstate);
 	unsigned int blocks_size =
-	    buddy_nblocks(heap_sizep2) * sizeof(blockinfo);
-	unsigned int total_size = heap_size + memarea_size + blocks_size;
-	unsigned int data_end = PROCESS_DATA_BASE + total_size;
+	    buddy_nblocks(HEAP_MAX_SIZEPOW2) * sizeof(blockinfo);
+	unsigned int heap_start =
+	    (PROCESS_DATA_BASE + state_size + blocks_size + PAGE_SIZE -
+	     1) & ~(PAGE_SIZE - 1);
+	unsigned int data_end = heap_start + (1 << HEAP_INITIAL_SIZEPOW2);
 
 	/*
 	 * Request this much memory from the kernel 
@@ -347,30 +583,180 @@ void init_userspace_malloc()
 	/*
 	 * Initialise the bookkeeping data 
 	 */
-	unsigned int memarea_start = PROCESS_DATA_BASE;
-	unsigned int heap_start = memarea_start + memarea_size;
-	unsigned int blocks_start = heap_start + heap_size;
-	memarea *ma = (memarea *) memarea_start;
-	char *heap = (char *)heap_start;
-	blockinfo *blocks = (blockinfo *) blocks_start;
-
-	buddy_init(ma, heap_sizep2, heap, blocks);
+	mallocstate *heap = user_heap;
+	char *mem = (char *)heap_start;
+	blockinfo *blocks = (blockinfo *) (PROCESS_DATA_BASE + state_size);
+
+	buddy_init(&heap->ma, HEAP_INITIAL_SIZEPOW2, mem, blocks);
+	memset(heap->pages, 0, sizeof(heap->pages));
+	unsigned int c;
+	for (c = 0; c < SMALL_CLASSES; c++) {
+		heap->classes[c].first = NO_PAGE;
+		heap->classes[c].nempty = 0;
+	}
+}
+
+/* grow_userspace_heap
+ * 
+ * Double the size of the heap, by extending the data segment with brk and then
+ * letting the buddy allocator know about the new memory. Returns -1 if the heap
+ * is already at its maximum size, or the kernel could not provide the memory.
+ */
+static int grow_userspace_heap(memarea * ma)
+{
+	if (HEAP_MAX_SIZEPOW2 <= ma->upper)
+		return -1;
+
+	unsigned int data_end = (unsigned int)ma->mem + (2 << ma->upper);
+	if (0 != brk((void *)data_end))
+		return -1;
+
+	buddy_grow(ma, ma->upper + 1);
+	return 0;
+}
+
+/* heap_alloc
+ * 
+ * Allocate a block from the buddy allocator, growing the heap as many times as
+ * necessary
+ */
+static void *heap_alloc(memarea * ma, unsigned int nbytes)
+{
+	void *ptr;
+	while ((NULL == (ptr = buddy_alloc(ma, nbytes))) &&
+	       (0 == grow_userspace_heap(ma))) ;
+	return ptr;
+}
+
+/* small_add / small_remove
+ * 
+ * Add a page to, or remove it from, the list of pages with free objects for its
+ * size class
+ */
+static void small_add(mallocstate * heap, smallclass * sc, unsigned int pg)
+{
+	heap->pages[pg].prev = NO_PAGE;
+	heap->pages[pg].next = sc->first;
+	if (NO_PAGE != sc->first)
+		heap->pages[sc->first].prev = pg;
+	sc->first = pg;
+}
+
+static void small_remove(mallocstate * heap, smallclass * sc, unsigned int pg)
+{
+	smallpage *sp = &heap->pages[pg];
+	if (NO_PAGE == sp->prev)
+		sc->first = sp->next;
+	else
+		heap->pages[sp->prev].next = sp->next;
+	if (NO_PAGE != sp->next)
+		heap->pages[sp->next].prev = sp->prev;
+}
+
+/* small_refill
+ * 
+ * Obtain a page from the buddy allocator for a size class, and put all of the
+ * objects in it on the page's free list. Returns NO_PAGE if the heap is full.
+ * The block must be exactly one page, since the objects are only carved out of
+ * the page that small_page and small_base refer to.
+ */
+static unsigned int small_refill(mallocstate * heap, unsigned int c)
+{
+	char *base = heap_alloc(&heap->ma, PAGE_SIZE);
+	if (NULL == base)
+		return NO_PAGE;
+	assert(PAGE_SIZE == buddy_size(&heap->ma, base));
+
+	unsigned int pg = small_page(heap, base);
+	unsigned int size = (c + 1) * SMALL_MIN;
+	smallpage *sp = &heap->pages[pg];
+	sp->class = c + 1;
+	sp->inuse = 0;
+	sp->free = NO_OBJECT;
+
+	int off;
+	for (off = (PAGE_SIZE / size - 1) * size; off >= 0; off -= size) {
+		small_link(base + off) = sp->free;
+		sp->free = off;
+	}
+
+	small_add(heap, &heap->classes[c], pg);
+	heap->classes[c].nempty++;
+	return pg;
+}
+
+/* small_alloc
+ * 
+ * Allocate an object from a size class
+ */
+static void *small_alloc(mallocstate * heap, unsigned int c)
+{
+	smallclass *sc = &heap->classes[c];
+	unsigned int pg = sc->first;
+	if ((NO_PAGE == pg) && (NO_PAGE == (pg = small_refill(heap, c))))
+		return NULL;
+
+	smallpage *sp = &heap->pages[pg];
+	char *obj = small_base(heap, pg) + sp->free;
+	sp->free = small_link(obj);
+	if (0 == sp->inuse++)
+		sc->nempty--;
+	if (NO_OBJECT == sp->free)
+		small_remove(heap, sc, pg);
+	return obj;
+}
+
+/* small_free
+ * 
+ * Return an object to the page it was allocated from. If this leaves the page
+ * with no objects allocated, it is given back to the buddy allocator, unless it
+ * is the only empty page in its size class.
+ */
+static void small_free(mallocstate * heap, unsigned int pg, void *ptr)
+{
+	smallpage *sp = &heap->pages[pg];
+	smallclass *sc = &heap->classes[sp->class - 1];
+	char *base = small_base(heap, pg);
+
+	if (NO_OBJECT == sp->free)
+		small_add(heap, sc, pg);
+	small_link(ptr) = sp->free;
+	sp->free = (char *)ptr - base;
+
+	if (0 < --sp->inuse)
+		return;
+
+	if (SMALL_MAX_EMPTY <= sc->nempty) {
+		small_remove(heap, sc, pg);
+		sp->class = 0;
+		buddy_free(&heap->ma, base);
+	} else {
+		sc->nempty++;
+	}
 }
 
 /* malloc - handles the memory allocation requests coming in.
  * 
- * This is just a wrapper around buddy_alloc, which passes in the
- * process's own memarea struct, to tell the allocation algorithm
- * which memory range and set of bookkeeping data to use. This differs
- * from kmalloc in that the latter allocates memory in the kernel's
- * private area, and can only be used in kernel mode.
+ * Small requests are served from the size class free lists, and very large ones
+ * are given a mapping of their own; anything else is passed to buddy_alloc,
+ * along with the process's own memarea struct, to tell the allocation algorithm
+ * which memory range and set of bookkeeping data to use. This differs from
+ * kmalloc in that the latter allocates memory in the kernel's private area, and
+ * can only be used in kernel mode. If there is no free block large enough, the
+ * heap is grown and the request retried.
  */
 void *malloc(unsigned int nbytes)
 {
 	if (!in_user_mode())
 		assert(!"malloc should not be called from kernel mode");
-	memarea *ma = (memarea *) PROCESS_DATA_BASE;
-	void *ptr = buddy_alloc(ma, nbytes);
+	mallocstate *heap = user_heap;
+	void *ptr;
+	if (SMALL_MAX >= nbytes)
+		ptr = small_alloc(heap, small_class(nbytes));
+	else if (MMAP_THRESHOLD < nbytes)
+		ptr = mmap_alloc(nbytes);
+	else
+		ptr = heap_alloc(&heap->ma, nbytes);
 	if (!ptr)
 		assert(!"Out of memory");
 	return ptr;
@@ -397,97 +783,75 @@ void *realloc(void *ptr, size_t size)
 	if (!in_user_mode())
 		assert(!"realloc should not be called from kernel mode");
 
-	/* If ptr is NULL, then the call is equivalent to malloc(size) */
-	if (ptr == NULL) {
-		printf("Warning ptr is NULL: calling malloc(%d)\n", size);
+	if (NULL == ptr)
 		return malloc(size);
-	} else if (size == 0) {
-		printf("Warning size = 0: calling free(ptr)\n");
+
+	if (0 == size) {
 		free(ptr);
 		return NULL;
 	}
-	///* If size is 0, then the call is equivalent to malloc(size) */       
-	//if (size == 0 && (ptr != NULL)) {
-	//free(ptr);
-	//return NULL;
-	//}
-}
 
-//static void *debug_realloc (void *block, size_t size) {
-  //if (size == 0) {
-    //freeblock(block);
-    //return NULL;
-  //}
-  //else if (memdebug_total+size > memdebug_memlimit)
-    //return NULL;  /* to test memory allocation errors */
-  //else {
-    //size_t realsize = HEADER+size+MARKSIZE;
-    //char *newblock = (char *)(malloc)(realsize);  /* alloc a new block */
-    //int i;
-    //if (realsize < size) return NULL;  /* overflow! */
-    //if (newblock == NULL) return NULL;
-    //if (block) {
-      //size_t oldsize = *blocksize(block);
-      //if (oldsize > size) oldsize = size;
-      //memcpy(newblock+HEADER, block, oldsize);
-      //freeblock(block);  /* erase (and check) old copy */
-    //}
-    //memdebug_total += size;
-    //if (memdebug_total > memdebug_maxmem) memdebug_maxmem = memdebug_total;
-    //memdebug_numblocks++;
-    //*(unsigned long *)newblock = size;
-    //for (i=0;i<MARKSIZE;i++)
-      //*(newblock+HEADER+size+i) = (char)(MARK+i);
-    //return newblock+HEADER;
-  //}
-//}
+	/*
+	 * A block in a mapping of its own can stay where it is if the mapping is
+	 * still large enough; otherwise it has to move 
+	 */
+	if (is_mmapped(ptr)) {
+		size_t oldsize = mmap_size(ptr) - MMAP_HEADER;
+		if (size <= oldsize)
+			return ptr;
+		void *newptr = malloc(size);
+		memmove(newptr, ptr, oldsize);
+		free(ptr);
+		return newptr;
+	}
+
+	/*
+	 * A small object can stay where it is if the new size is in the same size
+	 * class; otherwise it has to move 
+	 */
+	mallocstate *heap = user_heap;
+	smallpage *sp = &heap->pages[small_page(heap, ptr)];
+	if (0 != sp->class) {
+		unsigned int oldsize = sp->class * SMALL_MIN;
+		if ((SMALL_MAX >= size) && (small_class(size) + 1 == sp->class))
+			return ptr;
+		void *newptr = malloc(size);
+		memmove(newptr, ptr, (oldsize < size) ? oldsize : size);
+		free(ptr);
+		return newptr;
+	}
+
+	void *newptr;
+	while ((NULL == (newptr = buddy_realloc(&heap->ma, ptr, size))) &&
+	       (0 == grow_userspace_heap(&heap->ma))) ;
+	if (!newptr)
+		assert(!"Out of memory");
+	return newptr;
+}
 
 /* free
  * 
- * Wrapper around buddy_free, using the process's memarea struct as for malloc
+ * Return a small object to its size class, unmap a block that has a mapping of
+ * its own, or pass anything else to buddy_free, using the process's memarea
+ * struct as for malloc
  */
 void free(void *ptr)
 {
 	if (!in_user_mode())
 		assert(!"free should not be called from kernel mode");
-	memarea *ma = (memarea *) PROCESS_DATA_BASE;
-	buddy_free(ma, ptr);
-}
-
-memarea kernel_memarea;
-blockinfo kernel_blocks[(1 << (KERNEL_MEM_SIZEPOW2 - DEFAULT_LOWER))];
-
-/* kmalloc_init
- * 
- * Sets up the bookkeeping data for the region of kernel memory set aside for the
- * buddy allocator.
- */
-void kmalloc_init(void)
-{
-	buddy_init(&kernel_memarea, KERNEL_MEM_SIZEPOW2,
-		   (char *)KERNEL_MEM_BASE, kernel_blocks);
-}
-
-/* kmalloc
- * 
- * Wrapper around buddy_alloc for kernel memory; works similarly to the malloc
- * wrapper
- */
-void *kmalloc(unsigned int nbytes)
-{
-	void *ptr = buddy_alloc(&kernel_memarea, nbytes);
-	if (!ptr)
-		assert(!"Out of kernel memory");
-	return ptr;
-}
-
-/* kmalloc
- * 
- * Wrapper around buddy_free for kernel memory
- */
-void kfree(void *ptr)
-{
-	buddy_free(&kernel_memarea, ptr);
+	if (NULL == ptr)
+		return;
+	if (is_mmapped(ptr)) {
+		char *mem = (char *)ptr - MMAP_HEADER;
+		munmap(mem, mmap_size(ptr));
+		return;
+	}
+	mallocstate *heap = user_heap;
+	unsigned int pg = small_page(heap, ptr);
+	if (0 != heap->pages[pg].class)
+		small_free(heap, pg, ptr);
+	else
+		buddy_free(&heap->ma, ptr);
 }
 
 #endif				/* USERLAND */
@@ -31,11 +31,26 @@ syscall getdent     SYSCALL_GETDENT
 syscall chdir       SYSCALL_CHDIR
 syscall getcwd      SYSCALL_GETCWD
 syscall fork        SYSCALL_FORK
-syscall vfork       SYSCALL_VFORK
 syscall execve      SYSCALL_EXECVE
 syscall waitpid     SYSCALL_WAITPID
 syscall kill        SYSCALL_KILL
 syscall halt        SYSCALL_HALT
+syscall mmap        SYSCALL_MMAP
+syscall munmap      SYSCALL_MUNMAP
+syscall setpager    SYSCALL_SETPAGER
+syscall mappage     SYSCALL_MAPPAGE
+syscall nice        SYSCALL_NICE
+syscall setpriority SYSCALL_SETPRIORITY
+
+# vfork can't use the macro above: the child runs on the parent's stack, and will
+# overwrite the return address there as soon as it calls another function. So
+# the return address is popped into a register first, and jumped to afterwards.
+.globl vfork
+vfork:
+  popl %ecx
+  mov $SYSCALL_VFORK,%eax
+  int $INTERRUPT_SYSCALL
+  jmp *%ecx
 
 
 .globl in_user_mode
@@ -109,10 +109,13 @@ int parse_command(char *line, char **argv, int max)
 
 void run_program(const char *filename, char **argv)
 {
-	/* Fork off a child process  */
-	pid_t pid = fork();
+	/*
+	 * Start a child process with vfork, since all it is going to do is exec;
+	 * the parent is blocked until it does, so no memory needs to be copied 
+	 */
+	pid_t pid = vfork();
 	if (0 > pid) {
-		perror("fork");
+		perror("vfork");
 		return;
 	} else if (0 == pid) {
 		/* in child process */
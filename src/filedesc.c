@@ -8,6 +8,12 @@
 extern process *current_process;
 extern process processes[MAX_PROCESSES];
 
+/*
+ * All file handles, regardless of type, are allocated from this cache 
+ */
+kmem_cache filehandle_cache =
+    KMEM_CACHE("filehandle", sizeof(filehandle), NULL);
+
 /*
  * screen_write
  * 
@@ -42,7 +48,7 @@ static ssize_t screen_read(filehandle * fh, void *buf, size_t count)
  */
 static void screen_destroy(filehandle * fh)
 {
-	kfree(fh);
+	kmem_cache_free(&filehandle_cache, fh);
 }
 
 /*
@@ -61,7 +67,7 @@ static void screen_destroy(filehandle * fh)
  */
 filehandle *new_screen_handle(void)
 {
-	filehandle *fh = (filehandle *) kmalloc(sizeof(filehandle));
+	filehandle *fh = (filehandle *) kmem_cache_alloc(&filehandle_cache);
 	fh->type = FH_SCREEN;
 	fh->refcount = 1;
 	fh->write = screen_write;
@@ -22,16 +22,17 @@ int syscall_stat(const char *path, struct stat *buf)
 	/*
 	 * Ensure the supplied path name and buffer are valid pointers 
 	 */
-	if (!valid_string(path))
-		return -EFAULT;
-	if (!valid_pointer(buf, sizeof(struct stat)))
-		return -EFAULT;
+	int r = valid_string(path);
+	if (0 != r)
+		return r;
+	r = valid_write_pointer(buf, sizeof(struct stat));
+	if (0 != r)
+		return r;
 
 	/*
 	 * Get the directory_entry object for this path from the filesystem 
 	 */
 	directory_entry *entry;
-	int r;
 
 	char abs[PATH_MAX];
 	relative_to_absolute(abs, current_process->cwd, path, PATH_MAX);
@@ -72,12 +73,12 @@ static ssize_t file_read(filehandle * fh, void *buf, size_t count)
 
 static void file_destroy(filehandle * fh)
 {
-	kfree(fh);
+	kmem_cache_free(&filehandle_cache, fh);
 }
 
 static filehandle *new_file(int type)
 {
-	filehandle *fh = (filehandle *) kmalloc(sizeof(filehandle));
+	filehandle *fh = (filehandle *) kmem_cache_alloc(&filehandle_cache);
 	fh->type = type;
 	fh->refcount = 1;
 	fh->write = file_write;
@@ -88,8 +89,9 @@ static filehandle *new_file(int type)
 
 int syscall_open(const char *pathname, int flags)
 {
-	if (!valid_string(pathname))
-		return -EFAULT;
+	int r = valid_string(pathname);
+	if (0 != r)
+		return r;
 
 	int fd = -1;
 	for (fd = 0; fd < MAX_FDS; fd++) {
@@ -103,7 +105,6 @@ int syscall_open(const char *pathname, int flags)
 	relative_to_absolute(abspath, current_process->cwd, pathname, PATH_MAX);
 
 	directory_entry *entry;
-	int r;
 	if (0 != (r = get_directory_entry(filesystem, abspath, &entry)))
 		return r;
 
@@ -126,8 +127,9 @@ int syscall_open(const char *pathname, int flags)
 
 int syscall_getdent(int fd, struct dirent *entry)
 {
-	if (!valid_pointer(entry, sizeof(struct dirent)))
-		return -EFAULT;
+	int r = valid_write_pointer(entry, sizeof(struct dirent));
+	if (0 != r)
+		return r;
 
 	if ((0 > fd) || (MAX_FDS <= fd)
 	    || (NULL == current_process->filedesc[fd]))
@@ -152,12 +154,12 @@ int syscall_getdent(int fd, struct dirent *entry)
 
 int syscall_chdir(const char *path)
 {
-	if (!valid_string(path))
-		return -EFAULT;
+	int r = valid_string(path);
+	if (0 != r)
+		return r;
 
 	char newcwd[PATH_MAX];
 	relative_to_absolute(newcwd, current_process->cwd, path, PATH_MAX);
-	int r;
 	directory_entry *entry;
 	if (0 != (r = get_directory_entry(filesystem, newcwd, &entry)))
 		return r;
@@ -169,7 +171,7 @@ int syscall_chdir(const char *path)
 
 char *syscall_getcwd(char *buf, size_t size)
 {
-	if (!valid_pointer(buf, size))
+	if (0 != valid_write_pointer(buf, size))
 		return NULL;
 	snprintf(buf, size, "%s", current_process->cwd);
 	return buf;
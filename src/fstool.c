@@ -67,6 +67,16 @@ void output_append(output * b, const void *data, unsigned int size)
 	b->size += size;
 }
 
+/*
+ * Pad the output with zeroes up to a multiple of align bytes
+ */
+void output_align(output * b, unsigned int align)
+{
+	static const char zeroes[PAGE_SIZE];
+	unsigned int pad = (align - b->size % align) % align;
+	output_append(b, zeroes, pad);
+}
+
 void process_file(output * out, const char *path)
 {
 	int fd = open(path, O_RDONLY);
@@ -142,6 +152,12 @@ void process_dir(output * out, const char *path)
 		if (TYPE_DIR == newdirect->entries[i].type) {
 			process_dir(out, fullpath);
 		} else {
+			/*
+			 * File data starts on a page boundary, so that the
+			 * kernel can map it straight out of the image 
+			 */
+			output_align(out, PAGE_SIZE);
+			newdirect->entries[i].location = out->size;
 			process_file(out, fullpath);
 		}
 	}
@@ -8,6 +8,14 @@
 
 #define EMPTY 0xFFFFFFFF
 
+/* Minimum granularity for keeping track of blocks. 
+ * This affects the size of the blocks array in the memarea structure. See
+ * the description of buddy_init for further details. Note that this must
+ * be at least 3 (i.e. 2^3 = 8 bytes),since we store two 4 byte offsets in
+ * unused blocks for the (doubly linked) free list links.  
+ */
+#define DEFAULT_LOWER 8		/* 256 bytes */
+
 typedef struct blockinfo {
 	unsigned char sizem:7;
 	unsigned char used:1;
@@ -19,12 +27,16 @@ typedef struct memarea {
 	char *mem;
 	blockinfo *blocks;
 	unsigned int freelist[32];
+	unsigned int freemask;	/* bit m set if freelist[m] is non-empty */
 } memarea;
 
 void *buddy_alloc(memarea * ma, unsigned int nbytes);
 void buddy_free(memarea * ma, void *ptr);
+void *buddy_realloc(memarea * ma, void *ptr, unsigned int nbytes);
+unsigned int buddy_size(memarea * ma, void *ptr);
 unsigned int buddy_nblocks(unsigned int sizepow2);
 void buddy_init(memarea * ma, unsigned int sizepow2, char *membase,
 		blockinfo * blocks);
+void buddy_grow(memarea * ma, unsigned int sizepow2);
 
 #endif				/* BUDDY_H */
@@ -22,15 +22,27 @@
 #define USER_DATA_SEGMENT    0x20
 #define TSS_SEGMENT          0x28
 #define MAX_PROCESSES        32
+#define NICE_MIN             -20	/* highest scheduling priority */
+#define NICE_MAX             19	/* lowest scheduling priority */
 #define PROCESS_STACK_BASE   0x40000000	/* 1Gb */
-#define PROCESS_STACK_SIZE   (64*KB)
+#define PROCESS_STACK_SIZE   (64*KB)	/* initial size */
+#define PROCESS_STACK_MAX    (8*MB)	/* address space reserved for growth */
+#define PROCESS_STACK_GUARD  (64*KB)	/* bottom of reserve, never mapped */
+#define PROCESS_STACK_LIMIT  (PROCESS_STACK_BASE - PROCESS_STACK_MAX + \
+			      PROCESS_STACK_GUARD)
 #define KERNEL_MEM_BASE      (2*MB)
 #define KERNEL_MEM_SIZEPOW2  22
 #define KERNEL_MEM_SIZE      (4*MB)	/* 2^KERNEL_MEM_SIZEPOW2 */
 #define PAGE_START           (6*MB)
+#define KERNEL_VIRT_BASE     0xC0000000	/* 3Gb; must match link.ld */
+#define DIRECT_MAP_SIZE      (VMALLOC_BASE - KERNEL_VIRT_BASE)
+#define BOOT_MAP_SIZE        (16*MB)	/* mapped by start.s before page_init */
+#define VMALLOC_BASE         0xF0000000	/* 3.75Gb */
+#define VMALLOC_SIZE         (64*MB)
 #define PROCESS_DATA_BASE    0x20000000	/* 512Mb */
-#define PROCESS_DATA_MAX     (4*MB)
 #define PROCESS_TEXT_BASE    0x10000000	/* 256Mb */
+#define PROCESS_MMAP_BASE    0x50000000	/* 1.25Gb */
+#define PROCESS_MMAP_END     0x80000000	/* addresses must fit in an int */
 #define STDIN_FILENO         0
 #define STDOUT_FILENO        1
 #define STDERR_FILENO        2
@@ -84,6 +96,12 @@
 #define SYSCALL_KILL         20
 #define SYSCALL_HALT         21
 #define SYSCALL_VFORK		 22
+#define SYSCALL_MMAP         23
+#define SYSCALL_MUNMAP       24
+#define SYSCALL_SETPAGER     25
+#define SYSCALL_MAPPAGE      26
+#define SYSCALL_NICE         27
+#define SYSCALL_SETPRIORITY  28
 
 /*
  * errno values 
@@ -101,7 +119,8 @@
 #define EFAULT               12	/* Bad address */
 #define EAGAIN               13	/* Resource unavailable, try again */
 #define ECHILD               14	/* No child processes */
-#define ERRNO_MAX            14
+#define EIO                  15	/* I/O error */
+#define ERRNO_MAX            15
 #define ESUSPEND             1000
 
 #define EXIT_SUCCESS		 0
@@ -55,6 +55,30 @@ typedef struct {
 	char *cmdline;
 	unsigned int mods_count;
 	module *mods_addr;
+	unsigned int syms[4];
+	unsigned int mmap_length;
+	unsigned int mmap_addr;
 } __attribute__ ((__packed__)) multiboot;
 
+#define MULTIBOOT_INFO_MEMORY   0x001	/* mem_lower/mem_upper are valid */
+#define MULTIBOOT_INFO_MEM_MAP  0x040	/* mmap_length/mmap_addr are valid */
+
+/*
+ * BIOS memory map entry, as passed by the boot loader. The size field gives the
+ * size of the rest of the entry, which is not necessarily sizeof(memory_map).
+ */
+typedef struct {
+	unsigned int size;
+	unsigned int base_lo;
+	unsigned int base_hi;
+	unsigned int length_lo;
+	unsigned int length_hi;
+	unsigned int type;
+} __attribute__ ((__packed__)) memory_map;
+
+#define MEMORY_AVAILABLE        1
+
+#define next_memory_map(_mm) \
+  ((memory_map *)((char *)(_mm) + (_mm)->size + sizeof((_mm)->size)))
+
 #endif				/* FILESYSTEM_H */
@@ -72,20 +72,59 @@ void reboot(void);
 #define PAGE_READ_WRITE       0x2
 #define PAGE_READ_ONLY        0
 #define PAGE_PRESENT          0x1
+#define PAGE_GLOBAL           0x100
+#define PAGE_ACCESSED         0x20
+#define PAGE_DIRTY            0x40
+#define PAGE_COW              0x200	/* available to software */
+#define PAGE_SWAPPED          0x400	/* available to software */
+
+/*
+ * Bits of the error code pushed by the processor for a page fault 
+ */
+#define PAGE_FAULT_PRESENT    0x1
+#define PAGE_FAULT_WRITE      0x2
+#define PAGE_FAULT_USER       0x4
+
+/*
+ * Convert between physical addresses and the addresses at which the kernel
+ * accesses them through the direct map
+ */
+#define phys_to_virt(_p)      ((void *)((unsigned int)(_p) + KERNEL_VIRT_BASE))
+#define virt_to_phys(_v)      ((unsigned int)(_v) - KERNEL_VIRT_BASE)
 
 typedef unsigned int *page_dir;
 typedef unsigned int *page_table;
 
+extern unsigned int frames_free;
+extern unsigned int frames_used;
+extern page_dir kernel_pdir;
+
+void page_init(multiboot * mb);
+void *alloc_pages(unsigned int n);
+void free_pages(void *page, unsigned int n);
 void *alloc_page(void);
+void *alloc_zeroed_page(void);
+void refill_zero_pool(void);
+void ref_page(void *page);
 void free_page(void *page);
-void map_page(page_dir pdir, unsigned int logical, unsigned int physical,
-	      unsigned int access, unsigned int readwrite);
+int map_page(page_dir pdir, unsigned int logical, unsigned int physical,
+	     unsigned int access, unsigned int readwrite);
 int lookup_page(page_dir pdir, unsigned int logical, unsigned int *phys);
 void unmap_and_free_page(page_dir pdir, unsigned int logical);
-void identity_map(page_dir pdir, unsigned int start, unsigned int end,
-		  unsigned int access, unsigned int readwrite);
-void map_new_pages(page_dir pdir, unsigned int base, unsigned int npages);
+int map_range(page_dir pdir, unsigned int start, unsigned int end,
+	      unsigned int physical, unsigned int access, unsigned int readwrite);
+void unmap_range(page_dir pdir, unsigned int start, unsigned int end);
+int copy_range(page_dir src, page_dir dest, unsigned int start,
+	       unsigned int end);
+int copy_on_write(page_dir pdir, unsigned int logical);
+int swap_in_page(page_dir pdir, unsigned int logical);
+int map_demand_zero(page_dir pdir, unsigned int logical, int write);
+int map_copy(page_dir pdir, unsigned int logical, const void *data,
+	     unsigned int readwrite);
+page_dir new_page_dir(void);
 void free_page_dir(page_dir pdir);
+void copy_page(unsigned int dest, unsigned int src);
+void fill_page(unsigned int page, const void *data, unsigned int size);
 
 /*
  * start.s 
@@ -95,9 +134,12 @@ void set_tss(unsigned int tss_seg);
 void idle(void);
 unsigned char inb(unsigned int port);
 void outb(unsigned int port, unsigned int data);
+void insw(unsigned int port, void *buf, unsigned int count);
+void outsw(unsigned int port, const void *buf, unsigned int count);
 void enter_user_mode(void);
 void enable_paging(page_dir pdir);
-void disable_paging(void);
+int enable_global_pages(void);
+void invalidate_page(unsigned int logical);
 unsigned int getcr2(void);
 int in_user_mode(void);
 
@@ -166,6 +208,17 @@ filehandle *new_pipe_reader(pipe_buffer * p);
     }                                      \
   }
 
+#define list_append(_ll,_obj) {            \
+    if ((_ll)->last) {                     \
+      (_obj)->prev = (_ll)->last;          \
+      (_ll)->last->next = (_obj);          \
+      (_ll)->last = (_obj);                \
+    }                                      \
+    else {                                 \
+      (_ll)->first = (_ll)->last = (_obj); \
+    }                                      \
+  }
+
 #define list_remove(_ll,_obj) {            \
     if ((_ll)->first == (_obj))            \
       (_ll)->first = (_obj)->next;         \
@@ -179,6 +232,81 @@ filehandle *new_pipe_reader(pipe_buffer * p);
     (_obj)->prev = NULL;                   \
   }
 
+/*
+ * pagecache.c
+ */
+
+typedef struct cached_file {
+	struct cached_file *prev;
+	struct cached_file *next;
+	directory_entry *entry;	/* executable file the pages belong to */
+	unsigned int users;	/* number of processes running the file */
+	unsigned int npages;
+	unsigned int *pages;	/* frame holding each page, or 0 if not read in */
+} cached_file;
+
+typedef struct {
+	cached_file *first;
+	cached_file *last;
+} cached_filelist;
+
+cached_file *pagecache_get(directory_entry * entry);
+void pagecache_put(cached_file * cf);
+int pagecache_map(page_dir pdir, unsigned int logical, cached_file * cf,
+		  unsigned int offset, int write);
+
+/*
+ * ata.c
+ */
+
+#define ATA_SECTOR_SIZE 512
+
+unsigned int ata_init(void);
+int ata_read(unsigned int lba, unsigned int count, void *buf);
+int ata_write(unsigned int lba, unsigned int count, const void *buf);
+
+/*
+ * swap.c
+ */
+
+extern unsigned int swap_slots_free;
+
+void swap_init(void);
+unsigned int swap_alloc(void);
+void swap_dup(unsigned int slot);
+void swap_free(unsigned int slot);
+int swap_write(unsigned int slot, unsigned int page);
+int swap_read(unsigned int slot, unsigned int page);
+
+/*
+ * mmap.c
+ */
+
+#define VMA_TEXT   1		/* program text, from the page cache */
+#define VMA_DATA   2		/* heap, extended by brk */
+#define VMA_STACK  3		/* stack, grows downwards on demand */
+#define VMA_ANON   4		/* anonymous memory from mmap */
+#define VMA_FILE   5		/* file mapped with mmap, from the page cache */
+
+#define PAGER_GONE -2		/* the area's pager has exited */
+
+typedef struct vm_area {
+	struct vm_area *prev;
+	struct vm_area *next;
+	unsigned int start;
+	unsigned int end;
+	unsigned int prot;	/* PROT_READ, PROT_WRITE and/or PROT_EXEC */
+	unsigned int type;
+	struct cached_file *cache;	/* file backing the area, if any */
+	unsigned int offset;	/* offset in the file of start */
+	pid_t pager;		/* process supplying the pages, or PAGER_NONE */
+} vm_area;
+
+typedef struct {
+	vm_area *first;
+	vm_area *last;
+} vm_arealist;
+
 /*
  * process.c 
  */
@@ -195,12 +323,7 @@ typedef struct process {
 	int last_errno;
 	filehandle *filedesc[MAX_FDS];
 	char cwd[PATH_MAX];
-	unsigned int stack_start;
-	unsigned int stack_end;
-	unsigned int data_start;
-	unsigned int data_end;
-	unsigned int text_start;
-	unsigned int text_end;
+	vm_arealist vmas;	/* areas making up the address space */
 	pid_t parent_pid;
 	int exit_status;
 	int exited;
@@ -209,6 +332,12 @@ typedef struct process {
 	int mailbox_size;
 	int mailbox_alloc;
 	int receive_blocked;
+	struct process *vfork_parent;	/* process whose memory we are borrowing */
+	struct process *vfork_child;	/* child borrowing our memory */
+	unsigned int pager_wait;	/* page awaited from a pager, or 0 */
+	int nice;		/* NICE_MIN (highest priority) to NICE_MAX */
+	unsigned int ticks_left;	/* remaining time slice, in timer ticks */
+	struct runqueue *rq;	/* run queue the process is in, while ready */
 } process;
 
 typedef struct {
@@ -220,11 +349,32 @@ pid_t next_free_pid(void);
 void init_regs(regs * r, unsigned int stack_max, void (*start_addr) (void));
 pid_t get_free_pid(void);
 pid_t start_process(void (*start_address) (void));
+void free_process_memory(process * proc);
 void kill_process(process * proc);
+void vfork_release(process * child);
+void ready_process(process * proc);
+void scheduler_tick(void);
 void suspend_process(process * proc);
 void resume_process(process * proc);
 void context_switch(regs * r);
 
+/*
+ * mmap.c
+ */
+
+vm_area *vma_add(process * proc, unsigned int start, unsigned int end,
+		 unsigned int prot, unsigned int type);
+vm_area *vma_find(process * proc, unsigned int addr);
+vm_area *vma_segment(process * proc, unsigned int type);
+int vma_range_free(process * proc, unsigned int start, unsigned int end);
+vm_area *vma_grow_stack(process * proc, unsigned int addr);
+int vma_access_ok(unsigned int start, unsigned int end, unsigned int prot);
+int vma_fault(process * proc, vm_area * v, unsigned int addr, int write);
+int vma_fault_in(unsigned int start, unsigned int end, int write);
+int vma_copy(process * src, process * dest);
+void vma_clear(process * proc, int keep_stack);
+void vma_pager_exit(process * pager);
+
 /*
  * thread.c 
  */
@@ -267,22 +417,90 @@ typedef struct {
  */
 
 int valid_pointer(const void *ptr, unsigned int size);
+int valid_write_pointer(void *ptr, unsigned int size);
 int valid_string(const char *str);
+int deliver_message(process * dest, pid_t from, unsigned int tag,
+		    const void *data, size_t size);
 void syscall(regs * r);
 
 /*
- * buddy.c 
+ * kmalloc.c 
  */
 
+#define KMALLOC_MAX (64*KB)
+
 void kmalloc_init(void);
 void *kmalloc(unsigned int nbytes);
+void *kmalloc_low(unsigned int nbytes);
+void *krealloc(void *ptr, unsigned int nbytes);
 void kfree(void *ptr);
 
 /*
- * filedesc.c 
+ * vmalloc.c
+ */
+
+#define is_vmalloc_addr(_p) \
+  (((unsigned int)(_p) >= VMALLOC_BASE) && \
+   ((unsigned int)(_p) < VMALLOC_BASE + VMALLOC_SIZE))
+
+void vmalloc_init(void);
+void *vmalloc(unsigned int nbytes);
+void *vmalloc_aligned(unsigned int nbytes, unsigned int align);
+void *vrealloc(void *ptr, unsigned int nbytes);
+unsigned int vmalloc_size(void *ptr);
+void vfree(void *ptr);
+
+/*
+ * slab.c
+ */
+
+typedef struct slab {
+	struct slab *prev;	/* Pointers for full/partial/empty lists */
+	struct slab *next;
+	struct kmem_cache *cache;	/* cache this slab belongs to */
+	unsigned int inuse;	/* number of objects allocated */
+	void *free;		/* first free object */
+} slab;
+
+typedef struct {
+	slab *first;
+	slab *last;
+} slablist;
+
+typedef struct kmem_cache {
+	const char *name;
+	unsigned int objsize;	/* size of each object in bytes */
+	unsigned int slabsize;	/* size of each slab; 0 until first use */
+	unsigned int perslab;	/* number of objects per slab */
+	void (*ctor) (void *obj);	/* called once per object per slab */
+	slablist full;
+	slablist partial;
+	slablist empty;
+	unsigned int nempty;
+} kmem_cache;
+
+#define KMEM_CACHE(_name,_size,_ctor) \
+  { name: (_name), objsize: (_size), ctor: (_ctor) }
+
+void *kmem_cache_alloc(kmem_cache * cache);
+void kmem_cache_free(kmem_cache * cache, void *obj);
+
+/*
+ * filedesc.c
  */
 
+extern kmem_cache filehandle_cache;
+
 filehandle *new_screen_handle(void);
 void close_filehandle(filehandle * fh);
 
+/*
+ * syscall.c
+ */
+
+#define MAILBOX_SIZE 8
+#define MAILBOX_MAX  64
+
+extern kmem_cache mailbox_cache;
+
 #endif				/* KERNEL_H */
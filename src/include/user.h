@@ -116,6 +116,34 @@ typedef struct message {
 	char data[MAX_MESSAGE_SIZE];
 } message;
 
+/*
+ * Memory protection and flags for mmap 
+ */
+#define PROT_NONE      0x0
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+#define MAP_FAILED     ((void *) -1)
+
+/*
+ * User-space paging. A process registered with setpager as the pager for a
+ * region of another process's memory is sent a message with tag PAGER_FAULT_TAG
+ * whenever that process touches a page of the region which is not in memory. The
+ * message's from field is the faulting process, and its data a pager_fault. The
+ * faulting process waits until the pager supplies the page with mappage.
+ */
+#define PAGER_NONE       -1	/* setpager: go back to demand-zero memory */
+#define PAGER_FAULT_TAG  0x50414745	/* "PAGE" */
+
+typedef struct pager_fault {
+	void *addr;		/* start of the page */
+	int write;		/* whether the access was a write */
+} pager_fault;
+
 /*
  * System calls 
  */
@@ -142,6 +170,13 @@ int chdir(const char *path);
 char *getcwd(char *buf, size_t size);
 int kill(pid_t pid);
 void halt(void);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd,
+	   unsigned int offset);
+int munmap(void *addr, size_t len);
+int setpager(void *addr, size_t len, pid_t pager);
+int mappage(pid_t pid, void *addr, const void *data);
+int nice(int inc);
+int setpriority(pid_t pid, int nice);
 
 /*
  * Memory allocation 
@@ -162,6 +162,56 @@ void print_regs(regs * r)
 	kprintf("cr2 = %p\n", getcr2());
 }
 
+/*
+ * resolve_page_fault
+ * 
+ * Deal with page faults that are a normal part of running a process, rather
+ * than an error. The faulting address must lie within one of the process's
+ * areas (see mmap.c), and the access must be one the area allows. A write to a
+ * copy-on-write page is resolved by giving the process its own copy of the
+ * page. A page that is not present is brought in by vma_fault: it is read back
+ * in from the swap disk, read in through the page cache for an area backed by a
+ * file such as the text segment, or demand-zero. If the area has a pager, the
+ * process is suspended until the pager supplies the page, and another process
+ * is switched to. The stack grows downwards on demand, as far as
+ * PROCESS_STACK_LIMIT.
+ * 
+ * This applies both to accesses by the process itself and by the kernel on its
+ * behalf during a system call, although system calls fault in their arguments
+ * and the buffers they use beforehand (see get_syscall_args and valid_pointer),
+ * so that an error can be returned from the call instead. Returns 1 if the
+ * fault was resolved, and 0 if it was a genuine error.
+ */
+static int resolve_page_fault(regs * r)
+{
+	process *proc = current_process;
+	unsigned int addr = getcr2();
+	int write = PAGE_FAULT_WRITE & r->err_code;
+
+	if (NULL == proc)
+		return 0;
+
+	vm_area *v = vma_find(proc, addr);
+	if (NULL == v)
+		v = vma_grow_stack(proc, addr);
+	if ((NULL == v) || (PROT_NONE == v->prot) ||
+	    (write && !(PROT_WRITE & v->prot)))
+		return 0;
+
+	if (PAGE_FAULT_PRESENT & r->err_code)
+		return (write && (0 == copy_on_write(proc->pdir, addr)));
+
+	if ((PAGER_NONE != v->pager) && !(PAGE_FAULT_USER & r->err_code))
+		return 0;
+
+	int res = vma_fault(proc, v, addr, write);
+	if (-ESUSPEND == res) {
+		context_switch(r);
+		return 1;
+	}
+	return (0 == res);
+}
+
 void interrupt_handler(regs * r)
 {
 	unsigned int int_no = r->int_no;
@@ -189,11 +239,20 @@ void interrupt_handler(regs * r)
 		syscall(r);
 		break;
 	default:
+		if ((14 == int_no) && resolve_page_fault(r))
+			break;
+
 		if ((14 == int_no) && (NULL != current_process) &&
 		    !current_process->in_syscall) {
-			kprintf
-			    ("Process %d: page fault exception at address %p\n",
-			     current_process->pid, getcr2());
+			unsigned int addr = getcr2();
+			if ((addr >= PROCESS_STACK_BASE - PROCESS_STACK_MAX) &&
+			    (addr < PROCESS_STACK_LIMIT))
+				kprintf("Process %d: stack overflow\n",
+					current_process->pid);
+			else
+				kprintf
+				    ("Process %d: page fault exception at address %p\n",
+				     current_process->pid, addr);
 			kill_process(current_process);
 			context_switch(r);
 		} else if (MAX_EXCEPTION >= int_no) {
@@ -0,0 +1,252 @@
+/*
+ *      kmalloc.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+/*
+ * Kernel memory allocation
+ *
+ * Most kernel objects are small, and are allocated with the buddy allocator from
+ * the region of physical memory starting at KERNEL_MEM_BASE, which is reached
+ * through the direct map in every address space, and is already mapped by the
+ * boot page directory in start.s. However it is only KERNEL_MEM_SIZE bytes in
+ * total, so when it fills up, further buddy arenas of ARENA_SIZE bytes are
+ * created with vmalloc, and released again once nothing in them is allocated
+ * any more.
+ * Requests larger than KMALLOC_MAX bypass the arenas and are passed directly to
+ * vmalloc. kfree and krealloc work out where a block came from by its address.
+ *
+ * Memory obtained from vmalloc, including the additional arenas, is not
+ * physically contiguous and cannot be used before vmalloc_init. Structures the
+ * kernel needs while it is setting up paging at boot, or which must not
+ * themselves depend on the vmalloc region, such as page tables whose physical
+ * address is given to the processor, must be allocated with kmalloc_low, which
+ * always uses the primary arena.
+ */
+
+/*
+ * Size of each additional arena. Arenas are aligned to their size, so that
+ * blocks within them are aligned to their own size, as slab.c relies on.
+ */
+#define ARENA_SIZEPOW2  20	/* 1Mb */
+#define ARENA_SIZE      (1 << ARENA_SIZEPOW2)
+
+/*
+ * Number of completely free additional arenas to keep around before they start
+ * being released
+ */
+#define ARENA_MAX_EMPTY 1
+
+/*
+ * An additional arena. This structure, followed by the arena's blockinfo array,
+ * is stored in the pages immediately after the ARENA_SIZE bytes managed by the
+ * buddy allocator.
+ */
+typedef struct arena {
+	struct arena *prev;
+	struct arena *next;
+	memarea ma;
+	unsigned int inuse;	/* number of blocks allocated */
+} arena;
+
+typedef struct {
+	arena *first;
+	arena *last;
+} arenalist;
+
+memarea kernel_memarea;
+blockinfo kernel_blocks[(1 << (KERNEL_MEM_SIZEPOW2 - DEFAULT_LOWER))];
+
+static arenalist arenas = { first: NULL, last:NULL };
+static unsigned int arenas_empty = 0;	/* arenas with nothing allocated */
+
+/* kmalloc_init
+ *
+ * Sets up the bookkeeping data for the region of kernel memory set aside for the
+ * buddy allocator.
+ */
+void kmalloc_init(void)
+{
+	buddy_init(&kernel_memarea, KERNEL_MEM_SIZEPOW2,
+		   (char *)phys_to_virt(KERNEL_MEM_BASE), kernel_blocks);
+}
+
+/* arena_new
+ *
+ * Create an additional arena, returning NULL if there is not enough memory
+ */
+static arena *arena_new(void)
+{
+	unsigned int blocks_size =
+	    buddy_nblocks(ARENA_SIZEPOW2) * sizeof(blockinfo);
+	char *mem = vmalloc_aligned(ARENA_SIZE + sizeof(arena) + blocks_size,
+				    ARENA_SIZE);
+	if (NULL == mem)
+		return NULL;
+
+	arena *a = (arena *) (mem + ARENA_SIZE);
+	a->prev = NULL;
+	a->next = NULL;
+	a->inuse = 0;
+	buddy_init(&a->ma, ARENA_SIZEPOW2, mem, (blockinfo *) (a + 1));
+	list_add(&arenas, a);
+	arenas_empty++;
+	return a;
+}
+
+/* arena_of
+ *
+ * Find the additional arena containing a pointer, if any
+ */
+static arena *arena_of(void *ptr)
+{
+	arena *a;
+	for (a = arenas.first; a; a = a->next) {
+		if (((char *)ptr >= a->ma.mem) &&
+		    ((char *)ptr < a->ma.mem + ARENA_SIZE))
+			return a;
+	}
+	return NULL;
+}
+
+/* arena_alloc
+ *
+ * Allocate a block from an additional arena, keeping track of how many blocks are
+ * in use
+ */
+static void *arena_alloc(arena * a, unsigned int nbytes)
+{
+	void *ptr = buddy_alloc(&a->ma, nbytes);
+	if (ptr && (0 == a->inuse++))
+		arenas_empty--;
+	return ptr;
+}
+
+/* arena_free
+ *
+ * Free a block belonging to an additional arena. If this leaves the arena
+ * completely unused, it is released, unless there are not enough free arenas
+ * in reserve.
+ */
+static void arena_free(arena * a, void *ptr)
+{
+	buddy_free(&a->ma, ptr);
+	if (0 < --a->inuse)
+		return;
+
+	if (ARENA_MAX_EMPTY <= arenas_empty) {
+		list_remove(&arenas, a);
+		vfree(a->ma.mem);
+	} else {
+		arenas_empty++;
+	}
+}
+
+/* kmalloc
+ *
+ * Allocate kernel memory. Small requests are handled by the buddy allocator,
+ * trying each arena in turn and creating a new one if they are all full, and
+ * large ones by vmalloc.
+ */
+void *kmalloc(unsigned int nbytes)
+{
+	void *ptr;
+	if (KMALLOC_MAX < nbytes) {
+		ptr = vmalloc(nbytes);
+	} else {
+		ptr = buddy_alloc(&kernel_memarea, nbytes);
+
+		arena *a;
+		for (a = arenas.first; a && !ptr; a = a->next)
+			ptr = arena_alloc(a, nbytes);
+
+		if (!ptr && (NULL != (a = arena_new())))
+			ptr = arena_alloc(a, nbytes);
+	}
+	if (!ptr)
+		assert(!"Out of kernel memory");
+	return ptr;
+}
+
+/* kmalloc_low
+ *
+ * Allocate kernel memory from the primary arena regardless of the size
+ * requested. The memory returned is physically contiguous, and its physical
+ * address can be found with virt_to_phys.
+ */
+void *kmalloc_low(unsigned int nbytes)
+{
+	void *ptr = buddy_alloc(&kernel_memarea, nbytes);
+	if (!ptr)
+		assert(!"Out of kernel memory");
+	return ptr;
+}
+
+/* ksize
+ *
+ * Return the usable size of a block of kernel memory
+ */
+static unsigned int ksize(void *ptr)
+{
+	arena *a;
+	if (!is_vmalloc_addr(ptr))
+		return buddy_size(&kernel_memarea, ptr);
+	else if (NULL != (a = arena_of(ptr)))
+		return buddy_size(&a->ma, ptr);
+	else
+		return vmalloc_size(ptr);
+}
+
+/* krealloc
+ *
+ * Change the size of a block of kernel memory. Where possible this is done by
+ * buddy_realloc or vrealloc, both of which try to resize the block in place.
+ * Otherwise a new block is obtained from kmalloc and the data copied to it.
+ */
+void *krealloc(void *ptr, unsigned int nbytes)
+{
+	if (NULL == ptr)
+		return kmalloc(nbytes);
+
+	if (0 == nbytes) {
+		kfree(ptr);
+		return NULL;
+	}
+
+	void *newptr = NULL;
+	arena *a = NULL;
+	if (KMALLOC_MAX < nbytes) {
+		if (is_vmalloc_addr(ptr) && (NULL == arena_of(ptr)))
+			newptr = vrealloc(ptr, nbytes);
+	} else if (!is_vmalloc_addr(ptr)) {
+		newptr = buddy_realloc(&kernel_memarea, ptr, nbytes);
+	} else if (NULL != (a = arena_of(ptr))) {
+		newptr = buddy_realloc(&a->ma, ptr, nbytes);
+	}
+
+	if (NULL == newptr) {
+		unsigned int oldsize = ksize(ptr);
+		newptr = kmalloc(nbytes);
+		memmove(newptr, ptr, (oldsize < nbytes) ? oldsize : nbytes);
+		kfree(ptr);
+	}
+	return newptr;
+}
+
+/* kfree
+ *
+ * Release kernel memory obtained from kmalloc, kmalloc_low or krealloc
+ */
+void kfree(void *ptr)
+{
+	arena *a;
+	if (!is_vmalloc_addr(ptr))
+		buddy_free(&kernel_memarea, ptr);
+	else if (NULL != (a = arena_of(ptr)))
+		arena_free(a, ptr);
+	else
+		vfree(ptr);
+}
@@ -6,7 +6,7 @@
 
 #include <kernel.h>
 
-char *error_names[15] = {
+char *error_names[ERRNO_MAX + 1] = {
 	"Success",
 	"",
 	"Bad file descriptor",	/* EBADF */
@@ -21,7 +21,8 @@ char *error_names[15] = {
 	"Not enough space",	/* ENOMEM */
 	"Bad address",		/* EFAULT */
 	"Resource unavailable, try again",	/* EAGAIN */
-	"No child processes"	/* ECHILD */
+	"No child processes",	/* ECHILD */
+	"I/O error"		/* EIO */
 };
 
 char *strerror(int errnum)
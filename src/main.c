@@ -8,7 +8,7 @@
 #include <filesystem.h>
 #include <keyboard.h>
 
-screenchar *screen = (screenchar *) VIDEO_MEMORY;
+screenchar *screen = (screenchar *) phys_to_virt(VIDEO_MEMORY);
 
 unsigned int xpos = 0;
 unsigned int ypos = 0;
@@ -103,6 +103,7 @@ void timer_handler(regs * r)
 {
 	timer_ticks++;
 
+	scheduler_tick();
 	context_switch(r);
 }
 
@@ -248,9 +249,14 @@ void kmain(multiboot * mb)
 
 	kprintf("%s\n%s\n%s\n\n\n\n", VERSION, COPYRIGHT, DISCLAIMER);
 
+	/*
+	 * The boot loader gives us physical addresses, which we access through
+	 * the direct map. start.s has already converted mb itself.
+	 */
+	module *mods = (module *) phys_to_virt(mb->mods_addr);
 	assert(1 == mb->mods_count);
-	assert(mb->mods_addr[0].mod_end < 2 * MB);
-	filesystem = (char *)mb->mods_addr[0].mod_start;
+	assert(mods[0].mod_end < 2 * MB);
+	filesystem = (char *)phys_to_virt(mods[0].mod_start);
 	/*
 	 * Check here for the size of the RAM disk. Because we use a
 	 * hard-coded value of 2MB for the start of the kernel's private
@@ -260,10 +266,18 @@ void kmain(multiboot * mb)
 	 * the kernel and page memory regions, but suffices for our
 	 * purposes.
 	 */
-	if (mb->mods_addr[0].mod_end >= 2 * MB)
+	if (mods[0].mod_end >= 2 * MB)
 		assert
 		    (!"Filesystem goes beyond 2Mb limit. Please use smaller filesystem.");
 
+	/*
+	 * Find out how much memory we have, and set up the page allocator and the
+	 * vmalloc region, along with swap space if there is a disk for it
+	 */
+	page_init(mb);
+	vmalloc_init();
+	swap_init();
+
 	pid_t pid = start_process(launch_shell);
 	input_pipe = processes[pid].filedesc[STDIN_FILENO]->p;
 
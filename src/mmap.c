@@ -0,0 +1,599 @@
+/*
+ *      mmap.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+extern process *current_process;
+extern process processes[MAX_PROCESSES];
+
+/*
+ * Virtual memory areas
+ *
+ * A process's address space is described by a list of areas, each covering a
+ * page-aligned range of addresses with the same protection and the same source of
+ * pages, kept sorted by start address. The text, data and stack segments are
+ * areas like any other: text is backed by the page cache of the executable file,
+ * data is the demand-zero heap that brk extends, and the stack is demand-zero
+ * memory that grows downwards when the process faults below it. mmap adds further
+ * areas between PROCESS_MMAP_BASE and PROCESS_MMAP_END, which are either
+ * demand-zero or backed by the page cache of a file.
+ *
+ * An address is only part of the process if it lies within one of its areas, so
+ * the page fault handler, valid_pointer, fork and exit all work from this list.
+ * No pages are mapped when an area is created; they are filled in by the page
+ * fault handler as the process touches them.
+ *
+ * Anonymous areas can instead have their pages supplied by another process,
+ * called a pager, which is registered with setpager. When the process touches a
+ * page of the area that is not in memory, it is suspended, and the pager is sent
+ * a message describing the fault through its mailbox, in the same way as with
+ * send. The pager provides the page's contents with mappage, which maps them and
+ * lets the process continue. The kernel cannot wait for a pager in the middle of
+ * a system call, so memory in such an area cannot be passed to system calls.
+ */
+
+static kmem_cache vm_area_cache = KMEM_CACHE("vm_area", sizeof(vm_area), NULL);
+
+/*
+ * vma_new
+ *
+ * Allocate an area covering the specified range, and add it to a process's list,
+ * keeping the list sorted
+ */
+static vm_area *vma_new(process * proc, unsigned int start, unsigned int end,
+			unsigned int prot, unsigned int type)
+{
+	vm_area *v = (vm_area *) kmem_cache_alloc(&vm_area_cache);
+	memset(v, 0, sizeof(vm_area));
+	v->start = start;
+	v->end = end;
+	v->prot = prot;
+	v->type = type;
+	v->pager = PAGER_NONE;
+
+	vm_area *after = proc->vmas.last;
+	while ((NULL != after) && (after->start > start))
+		after = after->prev;
+
+	v->prev = after;
+	v->next = (NULL != after) ? after->next : proc->vmas.first;
+	if (NULL != v->next)
+		v->next->prev = v;
+	else
+		proc->vmas.last = v;
+	if (NULL != after)
+		after->next = v;
+	else
+		proc->vmas.first = v;
+	return v;
+}
+
+/*
+ * vma_add
+ *
+ * Create a new area in a process's address space, which must not overlap any of
+ * its existing areas
+ */
+vm_area *vma_add(process * proc, unsigned int start, unsigned int end,
+		 unsigned int prot, unsigned int type)
+{
+	assert(0 == start % PAGE_SIZE);
+	assert(0 == end % PAGE_SIZE);
+	assert(vma_range_free(proc, start, end));
+	return vma_new(proc, start, end, prot, type);
+}
+
+/*
+ * vma_free
+ *
+ * Unmap and free any pages mapped in an area, drop its reference to the page
+ * cache, and remove it from the process's list
+ */
+static void vma_free(process * proc, vm_area * v)
+{
+	unmap_range(proc->pdir, v->start, v->end);
+	pagecache_put(v->cache);
+	list_remove(&proc->vmas, v);
+	kmem_cache_free(&vm_area_cache, v);
+}
+
+/*
+ * vma_split
+ *
+ * If an area straddles the specified address, split it in two there
+ */
+static void vma_split(process * proc, unsigned int addr)
+{
+	vm_area *v = vma_find(proc, addr);
+	if ((NULL == v) || (v->start == addr))
+		return;
+
+	vm_area *upper = vma_new(proc, addr, v->end, v->prot, v->type);
+	upper->cache = v->cache;
+	upper->offset = v->offset + (addr - v->start);
+	upper->pager = v->pager;
+	if (NULL != upper->cache)
+		upper->cache->users++;
+	v->end = addr;
+}
+
+/*
+ * vma_find
+ *
+ * Find the area containing an address, or NULL if it is not part of the process
+ */
+vm_area *vma_find(process * proc, unsigned int addr)
+{
+	vm_area *v;
+	for (v = proc->vmas.first; v && (v->start <= addr); v = v->next) {
+		if (addr < v->end)
+			return v;
+	}
+	return NULL;
+}
+
+/*
+ * vma_segment
+ *
+ * Find the area for one of the process's segments, i.e. VMA_TEXT, VMA_DATA or
+ * VMA_STACK. A segment may be empty, in which case its area covers no addresses
+ * and is not found by vma_find. Returns NULL if the process has no such segment.
+ */
+vm_area *vma_segment(process * proc, unsigned int type)
+{
+	vm_area *v;
+	for (v = proc->vmas.first; v; v = v->next) {
+		if (type == v->type)
+			return v;
+	}
+	return NULL;
+}
+
+/*
+ * vma_range_free
+ *
+ * Check whether a range of addresses is not covered by any area
+ */
+int vma_range_free(process * proc, unsigned int start, unsigned int end)
+{
+	vm_area *v;
+	for (v = proc->vmas.first; v && (v->start < end); v = v->next) {
+		if ((v->end > start) && (v->end > v->start))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * vma_stack_reserve
+ *
+ * Find the stack if an address lies in the space reserved below it for growth,
+ * i.e. between PROCESS_STACK_LIMIT and the current bottom of the stack, and
+ * nothing else has been placed there. Otherwise returns NULL.
+ */
+static vm_area *vma_stack_reserve(process * proc, unsigned int addr)
+{
+	vm_area *stack = vma_segment(proc, VMA_STACK);
+	if ((NULL == stack) || (addr < PROCESS_STACK_LIMIT) ||
+	    (addr >= stack->start) ||
+	    !vma_range_free(proc, addr & PAGE_ADDRESS_MASK, stack->start))
+		return NULL;
+	return stack;
+}
+
+/*
+ * vma_grow_stack
+ *
+ * Called from the page fault handler when a process accesses an address that is
+ * not part of any area. If the address is in the reserve below the stack, the
+ * stack is extended down to cover it, and returned. Otherwise returns NULL.
+ */
+vm_area *vma_grow_stack(process * proc, unsigned int addr)
+{
+	vm_area *stack = vma_stack_reserve(proc, addr);
+	if (NULL != stack)
+		stack->start = addr & PAGE_ADDRESS_MASK;
+	return stack;
+}
+
+/*
+ * vma_access_ok
+ *
+ * Check whether every address in a range lies within an area of the current
+ * process that allows the specified access (PROT_READ and/or PROT_WRITE). The
+ * reserve below the stack counts as part of the stack, since a system call
+ * touching it will grow the stack just as the process itself would. Areas with a
+ * pager are never accessible to system calls.
+ */
+int vma_access_ok(unsigned int start, unsigned int end, unsigned int prot)
+{
+	process *proc = current_process;
+	unsigned int addr = start;
+	while (addr < end) {
+		vm_area *v = vma_find(proc, addr);
+		if (NULL == v)
+			v = vma_stack_reserve(proc, addr);
+		if ((NULL == v) || (prot != (v->prot & prot)) ||
+		    (PAGER_NONE != v->pager))
+			return 0;
+		addr = v->end;
+	}
+	return 1;
+}
+
+/*
+ * vma_copy
+ *
+ * Give a new process a copy of another's address space, as for fork. Each area
+ * is duplicated, and the pages in it shared copy-on-write (see copy_range).
+ * Returns -ENOMEM if a page table could not be allocated; the areas copied so far
+ * are left in the destination, to be released along with the rest of it.
+ */
+int vma_copy(process * src, process * dest)
+{
+	vm_area *v;
+	for (v = src->vmas.first; v; v = v->next) {
+		vm_area *copy =
+		    vma_new(dest, v->start, v->end, v->prot, v->type);
+		copy->cache = v->cache;
+		copy->offset = v->offset;
+		copy->pager = v->pager;
+		if (NULL != copy->cache)
+			copy->cache->users++;
+		if (0 != copy_range(src->pdir, dest->pdir, v->start, v->end))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * vma_clear
+ *
+ * Release all of a process's areas along with their pages, except for the stack
+ * if keep_stack is set. This is used when a process exits or execs.
+ */
+void vma_clear(process * proc, int keep_stack)
+{
+	vm_area *v = proc->vmas.first;
+	while (NULL != v) {
+		vm_area *next = v->next;
+		if (!keep_stack || (VMA_STACK != v->type))
+			vma_free(proc, v);
+		v = next;
+	}
+}
+
+/*
+ * vma_find_space
+ *
+ * Find the lowest unused range of len bytes in the mmap region. Returns 0 if
+ * there is none.
+ */
+static unsigned int vma_find_space(process * proc, unsigned int len)
+{
+	unsigned int start = PROCESS_MMAP_BASE;
+	vm_area *v;
+	for (v = proc->vmas.first; v; v = v->next) {
+		if (v->end <= start)
+			continue;
+		if (v->start >= start + len)
+			break;
+		start = v->end;
+	}
+	if ((start + len > PROCESS_MMAP_END) || (start + len < start))
+		return 0;
+	return start;
+}
+
+/*
+ * syscall_mmap
+ *
+ * Map len bytes of memory into the process's address space with the specified
+ * protection, returning its address. With MAP_ANONYMOUS the memory is new and
+ * zero-filled, and fd and offset are ignored. Otherwise fd must be an open file,
+ * and the memory holds its contents starting at offset, which must be a multiple
+ * of PAGE_SIZE. The file's pages are shared through the page cache, and come
+ * straight from the file system image where possible (see pagecache.c), so
+ * reading a file this way involves no copying. All mappings are private: a
+ * write to a page of a file gives the process its own copy, and the file is
+ * never changed. Accessing a page entirely beyond the end of the file is an
+ * error.
+ *
+ * The memory is placed in the mmap region, at addr if that range is free, or
+ * otherwise at the lowest address that is. With MAP_FIXED it must go at addr,
+ * which must be page-aligned, lie within the region and not overlap an existing
+ * mapping.
+ */
+void *syscall_mmap(void *addr, size_t len, int prot, int flags, int fd,
+		   unsigned int offset)
+{
+	process *proc = current_process;
+	unsigned int start = (unsigned int)addr;
+	filehandle *fh = NULL;
+
+	if ((0 == len) || (PROCESS_MMAP_END - PROCESS_MMAP_BASE < len) ||
+	    (0 != (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))))
+		return (void *)-EINVAL;
+	if (!(flags & MAP_ANONYMOUS)) {
+		if ((0 > fd) || (MAX_FDS <= fd) ||
+		    (NULL == (fh = proc->filedesc[fd])))
+			return (void *)-EBADF;
+		if (FH_DIR == fh->type)
+			return (void *)-EISDIR;
+		if ((FH_FILE != fh->type) || (0 != offset % PAGE_SIZE) ||
+		    (offset + len < offset))
+			return (void *)-EINVAL;
+	}
+	len = (len + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK;
+
+	int fits = (start >= PROCESS_MMAP_BASE) &&
+	    (start <= PROCESS_MMAP_END - len) && (0 == start % PAGE_SIZE) &&
+	    vma_range_free(proc, start, start + len);
+	if (flags & MAP_FIXED) {
+		if (!fits)
+			return (void *)-EINVAL;
+	} else if (!fits && (0 == (start = vma_find_space(proc, len)))) {
+		return (void *)-ENOMEM;
+	}
+
+	if (NULL == fh) {
+		vma_add(proc, start, start + len, prot, VMA_ANON);
+	} else {
+		vm_area *v = vma_add(proc, start, start + len, prot, VMA_FILE);
+		v->cache = pagecache_get(fh->entry);
+		v->offset = offset;
+	}
+	return (void *)start;
+}
+
+/*
+ * syscall_munmap
+ *
+ * Remove the mappings for a range of addresses, releasing the pages in it. Areas
+ * which only partly overlap the range are trimmed, or split in two. Only memory
+ * obtained from mmap can be unmapped; if the range includes part of the text,
+ * data or stack segments, nothing is changed and -EINVAL is returned.
+ */
+int syscall_munmap(void *addr, size_t len)
+{
+	process *proc = current_process;
+	unsigned int start = (unsigned int)addr;
+	unsigned int end = start + ((len + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK);
+	vm_area *v;
+
+	if ((0 != start % PAGE_SIZE) || (0 == len) || (end < start))
+		return -EINVAL;
+
+	for (v = proc->vmas.first; v && (v->start < end); v = v->next) {
+		if ((v->end > start) && (VMA_ANON != v->type) &&
+		    (VMA_FILE != v->type))
+			return -EINVAL;
+	}
+
+	vma_split(proc, start);
+	vma_split(proc, end);
+	v = proc->vmas.first;
+	while ((NULL != v) && (v->start < end)) {
+		vm_area *next = v->next;
+		if (v->start >= start)
+			vma_free(proc, v);
+		v = next;
+	}
+	return 0;
+}
+
+/*
+ * syscall_setpager
+ *
+ * Make a process the pager for a range of the calling process's anonymous
+ * memory, which must have been obtained from mmap with MAP_ANONYMOUS. Areas only
+ * partly inside the range are split. From now on, pages in the range which are
+ * not in memory are requested from the pager (see vma_pager_request), although
+ * pages already present are kept. With PAGER_NONE, the range goes back to being
+ * ordinary demand-zero memory. A process cannot be its own pager, since it would
+ * be waiting for itself.
+ */
+int syscall_setpager(void *addr, size_t len, pid_t pager)
+{
+	process *proc = current_process;
+	unsigned int start = (unsigned int)addr;
+	unsigned int end = start + ((len + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK);
+	unsigned int a;
+	vm_area *v;
+
+	if ((0 != start % PAGE_SIZE) || (0 == len) || (end < start))
+		return -EINVAL;
+	if (PAGER_NONE != pager) {
+		if ((0 > pager) || (MAX_PROCESSES <= pager) ||
+		    !processes[pager].exists || processes[pager].exited)
+			return -ESRCH;
+		if (pager == proc->pid)
+			return -EINVAL;
+	}
+
+	for (a = start; a < end; a = v->end) {
+		v = vma_find(proc, a);
+		if ((NULL == v) || (VMA_ANON != v->type))
+			return -EINVAL;
+	}
+
+	vma_split(proc, start);
+	vma_split(proc, end);
+	for (v = vma_find(proc, start); v && (v->start < end); v = v->next)
+		v->pager = pager;
+	return 0;
+}
+
+/*
+ * vma_pager_request
+ *
+ * Called from vma_fault when a process touches a page of an area with a pager
+ * that is not in memory. The pager is sent a PAGER_FAULT_TAG message, and the
+ * process is suspended until the pager supplies the page with mappage, at which
+ * point it retries the access. Returns -ESRCH if the pager has exited, or -ENOMEM
+ * if its mailbox is full; the fault is then an error.
+ */
+static int vma_pager_request(process * proc, vm_area * v, unsigned int addr,
+			     int write)
+{
+	pager_fault fault;
+
+	if ((0 > v->pager) || !processes[v->pager].exists ||
+	    processes[v->pager].exited)
+		return -ESRCH;
+
+	fault.addr = (void *)(addr & PAGE_ADDRESS_MASK);
+	fault.write = write ? 1 : 0;
+	if (0 != deliver_message(&processes[v->pager], proc->pid,
+				 PAGER_FAULT_TAG, &fault, sizeof(fault)))
+		return -ENOMEM;
+
+	proc->pager_wait = addr & PAGE_ADDRESS_MASK;
+	suspend_process(proc);
+	return 0;
+}
+
+/*
+ * vma_fault
+ *
+ * Bring in a page of an area that is not present in memory, because the process
+ * or the kernel on its behalf has touched it. A page that has been swapped out is
+ * read back in from the swap disk. If the area has a pager, the page is requested
+ * from it and -ESUSPEND returned, since the process has to wait for it. A page of
+ * an area backed by a file, such as the text segment, is read in through the page
+ * cache, and any other area is demand-zero. Returns 0 if the page was mapped,
+ * -EFAULT if it lies beyond the end of the file, or -ENOMEM or -EIO if it could
+ * not be brought in.
+ */
+int vma_fault(process * proc, vm_area * v, unsigned int addr, int write)
+{
+	int r = swap_in_page(proc->pdir, addr);
+	if (-EFAULT != r)
+		return r;
+
+	if (PAGER_NONE != v->pager) {
+		r = vma_pager_request(proc, v, addr, write);
+		return (0 == r) ? -ESUSPEND : r;
+	}
+
+	if (NULL != v->cache) {
+		unsigned int offset =
+		    (addr & PAGE_ADDRESS_MASK) - v->start + v->offset;
+		return pagecache_map(proc->pdir, addr, v->cache, offset, write);
+	}
+
+	return map_demand_zero(proc->pdir, addr, write);
+}
+
+/*
+ * vma_fault_in
+ *
+ * Make sure every page in a range of the current process is in memory before a
+ * system call accesses it, so that the kernel does not take a page fault that
+ * cannot be resolved part way through the call. If the kernel is going to write
+ * to the range, copy-on-write pages are also copied now. The range must already
+ * have been checked with vma_access_ok. Returns 0 on success, or -ENOMEM or -EIO
+ * if a page could not be brought in; the system call should then fail with that
+ * error.
+ */
+int vma_fault_in(unsigned int start, unsigned int end, int write)
+{
+	process *proc = current_process;
+	unsigned int addr;
+	for (addr = start & PAGE_ADDRESS_MASK; addr < end; addr += PAGE_SIZE) {
+		unsigned int phys;
+		if (lookup_page(proc->pdir, addr, &phys)) {
+			/*
+			 * -EFAULT means the page is not copy-on-write, and so
+			 * already writable
+			 */
+			if (write &&
+			    (-ENOMEM == copy_on_write(proc->pdir, addr)))
+				return -ENOMEM;
+			continue;
+		}
+
+		vm_area *v = vma_find(proc, addr);
+		if (NULL == v)
+			v = vma_grow_stack(proc, addr);
+		assert(NULL != v);
+		int r = vma_fault(proc, v, addr, write);
+		if (0 != r)
+			return r;
+	}
+	return 0;
+}
+
+/*
+ * syscall_mappage
+ *
+ * Supply a page of an area that the calling process is the pager for. A page of
+ * data is copied from the caller's address space and mapped at addr in process
+ * pid, with the area's protection. If data is NULL, the page is zero-filled. If
+ * pid is waiting for this page, it is resumed. A page can also be supplied before
+ * it has been asked for, but never replaces one that is already there.
+ */
+int syscall_mappage(pid_t pid, void *addr, const void *data)
+{
+	unsigned int page = (unsigned int)addr & PAGE_ADDRESS_MASK;
+
+	if ((0 > pid) || (MAX_PROCESSES <= pid) || !processes[pid].exists ||
+	    processes[pid].exited)
+		return -ESRCH;
+	int r = (NULL != data) ? valid_pointer(data, PAGE_SIZE) : 0;
+	if (0 != r)
+		return r;
+
+	process *proc = &processes[pid];
+	vm_area *v = vma_find(proc, page);
+	if ((NULL == v) || (NULL != proc->vfork_child))
+		return -EINVAL;
+	if (v->pager != current_process->pid)
+		return -EPERM;
+
+	r = map_copy(proc->pdir, page, data, (v->prot & PROT_WRITE) ?
+			 PAGE_READ_WRITE : PAGE_READ_ONLY);
+	if (0 != r)
+		return r;
+
+	if (proc->pager_wait == page) {
+		proc->pager_wait = 0;
+		resume_process(proc);
+	}
+	return 0;
+}
+
+/*
+ * vma_pager_exit
+ *
+ * Called when a process exits, to detach it from any areas it was the pager
+ * for. Faults in those areas are errors from now on, and processes already
+ * waiting for a page from it are killed, since they would never be resumed.
+ */
+void vma_pager_exit(process * pager)
+{
+	pid_t pid;
+	for (pid = 0; pid < MAX_PROCESSES; pid++) {
+		process *proc = &processes[pid];
+		int stranded = 0;
+		vm_area *v;
+		if (!proc->exists || proc->exited)
+			continue;
+		for (v = proc->vmas.first; v; v = v->next) {
+			if (v->pager != pager->pid)
+				continue;
+			v->pager = PAGER_GONE;
+			if ((proc->pager_wait >= v->start) &&
+			    (proc->pager_wait < v->end))
+				stranded = 1;
+		}
+		if (stranded) {
+			kprintf("Process %d: pager %d exited\n", proc->pid,
+				pager->pid);
+			kill_process(proc);
+		}
+	}
+}
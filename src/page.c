@@ -6,89 +6,693 @@
 
 #include <kernel.h>
 
+extern process *current_process;
+extern process processes[MAX_PROCESSES];
+
 /*
  * Page table management
  * 
  * This file contains a set of functions for allocating pages to both the kernel
  * and user processes. It is responsible for managing all of the physical memory
  * above PAGE_START (defined in constants.h). 
+ * 
+ * The kernel runs in the top part of every address space, from KERNEL_VIRT_BASE
+ * upwards, and user processes in the part below it. All of physical memory (up
+ * to DIRECT_MAP_SIZE bytes) is mapped permanently at KERNEL_VIRT_BASE, so any
+ * frame, including the page directories and page tables of processes, can be
+ * accessed at phys_to_virt(frame) no matter which address space is current.
+ * Changes to a process's mappings are made this way with paging on, and the TLB
+ * entries for the affected pages are invalidated individually, so there is no
+ * need to flush the whole TLB.
+ * 
+ * If a swap disk is available (see swap.c), process memory can be paged out when
+ * the frame allocator runs short, and is read back in by the page fault handler.
  */
 
 /*
- * Address of first piece of unused memory 
+ * These external variables correspond to symbols defined by the linker,
+ * which tell us where the kernel's code and data sections begin and
+ * end. We use these when setting up paging so that user-level processes
+ * are given access to the kernel's code, but not its data.
  */
-unsigned int page_end = PAGE_START;
+extern const unsigned int code;
+extern const unsigned int data;
+extern const unsigned int end;
+
+#define KERNEL_CODE_START    virt_to_phys(&code)
+#define KERNEL_CODE_END      virt_to_phys(&data)
+#define KERNEL_GLOBALS_START virt_to_phys(&data)
+#define KERNEL_GLOBALS_END   virt_to_phys(&end)
 
 /*
- * Linked list of free pages 
+ * Template page directory holding the kernel's mappings. The page tables it
+ * refers to are built once at boot time, and every process's page directory
+ * shares them by copying the corresponding page directory entries, rather than
+ * building its own direct map of physical memory. Like all page directories,
+ * this is a physical address.
  */
-typedef struct freelist {
-	struct freelist *next;
-} freelist;
-freelist *page_free = NULL;
+page_dir kernel_pdir = NULL;
 
 /*
- * Total number of pages allocated 
+ * Bitmap of physical page frames, with one bit per frame starting at PAGE_START.
+ * A set bit means the frame is in use (or does not exist, e.g. because it lies
+ * in a hole reported by the BIOS memory map).
  */
-unsigned int npages = 0;
+unsigned int *frame_map = NULL;
 
 /*
- * alloc_page
- * 
- * Allocate a new page. This uses a simple free list allocation scheme, which is
- * simple to implement since all pages are the same size. The page_free variable
- * points to the head of a linked list of free pages, and if this is non-null, then
- * we simply take the first page in the list and make page_free point to the next
- * page in the list. Alternatively, if the free list is empty, we just take a page
- * from the next available address, specified by page_end.
+ * Reference count for each frame, i.e. the number of page table entries that map
+ * it. Frames are shared between processes by copy-on-write fork; free_page only
+ * returns a frame to the allocator once the last reference is dropped.
+ */
+unsigned char *frame_refs = NULL;
+
+/*
+ * Number of frames covered by frame_map, i.e. the number of pages between
+ * PAGE_START and the top of physical memory
+ */
+unsigned int frame_count = 0;
+
+/*
+ * Index of the word in frame_map at which to begin searching for free frames.
+ * All words before this are known to be full.
+ */
+unsigned int frame_hint = 0;
+
+/*
+ * Number of frames currently free, and currently allocated 
+ */
+unsigned int frames_free = 0;
+unsigned int frames_used = 0;
+
+/*
+ * Pool of frames that have already been zeroed, so that alloc_zeroed_page does
+ * not have to clear a page on the critical path of fork, exec, or brk. The pool
+ * is topped up a few pages at a time whenever the scheduler finds it has no
+ * process to run.
+ */
+#define ZERO_POOL_SIZE   64
+#define ZERO_POOL_BATCH  8
+
+unsigned int zero_pool[ZERO_POOL_SIZE];
+unsigned int zero_pool_count = 0;
+
+/*
+ * A page of zeroes which is mapped read-only and copy-on-write wherever a process
+ * reads demand-zero memory that it has not written to yet. It may be mapped any
+ * number of times, so it is not reference counted, and is never freed.
+ */
+unsigned int shared_zero_page = 0;
+
+#define frame_of(_addr)   (((unsigned int)(_addr) - PAGE_START) / PAGE_SIZE)
+#define frame_addr(_f)    ((_f) * PAGE_SIZE + PAGE_START)
+#define frame_is_used(_f) (frame_map[(_f) / 32] & (1 << ((_f) % 32)))
+#define set_frame_used(_f) frame_map[(_f) / 32] |= (1 << ((_f) % 32))
+#define set_frame_free(_f) frame_map[(_f) / 32] &= ~(1 << ((_f) % 32))
+
+#define TABLE_SPAN        (1024 * PAGE_SIZE)	/* memory covered by a page table */
+#define table_end(_addr)  (((_addr) & ~(TABLE_SPAN - 1)) + TABLE_SPAN)
+
+/*
+ * The entry for a page that has been swapped out holds its slot number in place
+ * of a frame address (see swap.c)
+ */
+#define swap_slot(_pte)   (((_pte) & PAGE_ADDRESS_MASK) / PAGE_SIZE)
+
+/*
+ * Position of the clock hand used by swap_out_page: the process, and the address
+ * within it, at which to resume scanning for a page to evict
+ */
+static unsigned int clock_pid = 0;
+static unsigned int clock_addr = 0;
+
+/*
+ * get_table
  * 
- * At kernel boot time, the free list is empty, and page_end points to the first
- * memory address available for page allocation, which is PAGE_START.
+ * Find the page table covering a logical address in a page directory, walking
+ * the directory through the direct map. If there is no such page table, one is
+ * allocated when create is set; otherwise, or if there is no memory for it, NULL
+ * is returned.
  */
-void *alloc_page(void)
+static page_table get_table(page_dir pdir, unsigned int logical, int create)
 {
-	void *address;
-	npages++;
+	unsigned int dirindex = logical / TABLE_SPAN;	/* index into page directory */
+	page_dir dir = (page_dir) phys_to_virt(pdir);
 
 	/*
-	 * Find the next free page 
+	 * Get page directory entry, creating if necessary. The permission bits here
+	 * just act as a filter for the entries in the page table, so we can just
+	 * specify full user access here; it's the permission bits in each page table
+	 * entry that really count. 
 	 */
-	if (NULL == page_free) {
-		/*
-		 * Free list is empty; choose next available address 
-		 */
-		address = (void *)page_end;
-		page_end += PAGE_SIZE;
+	if (!(dir[dirindex] & PAGE_PRESENT)) {
+		if (!create)
+			return NULL;
+		unsigned int dirpage = (unsigned int)alloc_zeroed_page();
+		if (0 == dirpage)
+			return NULL;
+		dir[dirindex] =
+		    dirpage | PAGE_PRESENT | PAGE_USER | PAGE_READ_WRITE;
+	}
+
+	return (page_table) phys_to_virt(dir[dirindex] & PAGE_ADDRESS_MASK);
+}
+
+/*
+ * get_pte
+ * 
+ * Find the page table entry for a logical address in a page directory, as for
+ * get_table
+ */
+static unsigned int *get_pte(page_dir pdir, unsigned int logical, int create)
+{
+	page_table ptable = get_table(pdir, logical, create);
+	if (NULL == ptable)
+		return NULL;
+	return &ptable[(logical / PAGE_SIZE) % 1024];
+}
+
+/*
+ * free_table_if_empty
+ * 
+ * Release the page table covering a logical address in a page directory if it no
+ * longer maps anything. The processor may have cached the directory entry, so it
+ * is invalidated as well.
+ */
+static void free_table_if_empty(page_dir pdir, unsigned int logical)
+{
+	page_dir dir = (page_dir) phys_to_virt(pdir);
+	unsigned int dirindex = logical / TABLE_SPAN;
+	page_table ptable =
+	    (page_table) phys_to_virt(dir[dirindex] & PAGE_ADDRESS_MASK);
+	unsigned int i;
+	for (i = 0; i < 1024; i++) {
+		if (0 != ptable[i])
+			return;
+	}
+	free_page((void *)(dir[dirindex] & PAGE_ADDRESS_MASK));
+	dir[dirindex] = 0;
+	invalidate_page(logical);
+}
+
+/*
+ * copy_page
+ * 
+ * Copy the contents of one frame to another
+ */
+void copy_page(unsigned int dest, unsigned int src)
+{
+	memmove(phys_to_virt(dest), phys_to_virt(src), PAGE_SIZE);
+}
+
+/*
+ * fill_page
+ * 
+ * Copy size bytes of data from kernel memory into a frame, or a whole page if
+ * size is larger than that, and clear the rest of the frame
+ */
+void fill_page(unsigned int page, const void *data, unsigned int size)
+{
+	char *to = (char *)phys_to_virt(page);
+	if (PAGE_SIZE <= size) {
+		memmove(to, data, PAGE_SIZE);
+	} else {
+		memmove(to, data, size);
+		memset(to + size, 0, PAGE_SIZE - size);
+	}
+}
+
+/*
+ * release_frames
+ * 
+ * Mark a range of physical memory as available for allocation. Only whole frames
+ * lying between PAGE_START and the top of memory are considered.
+ */
+static void release_frames(unsigned int start, unsigned int end)
+{
+	if (start < PAGE_START)
+		start = PAGE_START;
+	start = (start + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK;
+	end &= PAGE_ADDRESS_MASK;
+	if (end > frame_addr(frame_count))
+		end = frame_addr(frame_count);
+
+	unsigned int addr;
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		unsigned int f = frame_of(addr);
+		if (frame_is_used(f)) {
+			set_frame_free(f);
+			frames_free++;
+		}
+	}
+}
+
+/*
+ * direct_map
+ * 
+ * Map the specified range of physical memory into kernel_pdir at the same offset
+ * from KERNEL_VIRT_BASE. Page tables for it come from the frame allocator, so
+ * this can only be used while page_init is setting up the kernel's address
+ * space.
+ */
+static void
+direct_map(unsigned int start, unsigned int end, unsigned int access,
+	   unsigned int readwrite)
+{
+	if (0 != map_range(kernel_pdir, KERNEL_VIRT_BASE + start,
+			   KERNEL_VIRT_BASE + end, start, access, readwrite))
+		fatal("Not enough memory for kernel page tables");
+}
+
+/*
+ * page_init
+ * 
+ * Set up the physical frame allocator, based on the information about installed
+ * memory that the boot loader passes to us. If a full BIOS memory map is
+ * available, we use it to find out which regions are usable; otherwise we fall
+ * back to mem_upper, which gives the amount of contiguous memory above 1Mb.
+ * 
+ * Memory above DIRECT_MAP_SIZE is ignored, since the kernel would have no way
+ * of accessing it.
+ * 
+ * Until the kernel's page directory has been built, we are still running on
+ * the boot page directory set up by start.s, which only maps the first
+ * BOOT_MAP_SIZE bytes of memory. The bitmap lives in the kernel heap, which is
+ * below that, and the frames allocated for kernel_pdir and the direct map's page
+ * tables are taken from the bottom of the frame region, so they are too.
+ */
+void page_init(multiboot * mb)
+{
+	unsigned int mem_top = 0;
+	memory_map *mm;
+	memory_map *mm_end = NULL;
+
+	if (mb->flags & MULTIBOOT_INFO_MEM_MAP) {
+		mm = (memory_map *) phys_to_virt(mb->mmap_addr);
+		mm_end = (memory_map *) phys_to_virt(mb->mmap_addr +
+						     mb->mmap_length);
+		for (; mm < mm_end; mm = next_memory_map(mm)) {
+			if ((MEMORY_AVAILABLE != mm->type) || (0 != mm->base_hi))
+				continue;
+			unsigned int end = mm->base_lo + mm->length_lo;
+			if ((0 != mm->length_hi) || (end < mm->base_lo))
+				end = PAGE_ADDRESS_MASK;
+			if (end > mem_top)
+				mem_top = end;
+		}
+	} else if (mb->flags & MULTIBOOT_INFO_MEMORY) {
+		mem_top = 1 * MB + mb->mem_upper * KB;
+	}
+
+	if (mem_top <= PAGE_START)
+		fatal("Not enough memory");
+	if (mem_top > DIRECT_MAP_SIZE)
+		mem_top = DIRECT_MAP_SIZE;
+
+	frame_count = (mem_top - PAGE_START) / PAGE_SIZE;
+	unsigned int nwords = (frame_count + 31) / 32;
+	frame_map = (unsigned int *)kmalloc_low(nwords * sizeof(unsigned int));
+	memset(frame_map, 0xFF, nwords * sizeof(unsigned int));
+	frame_refs = (unsigned char *)kmalloc_low(frame_count);
+	memset(frame_refs, 0, frame_count);
+
+	if (mb->flags & MULTIBOOT_INFO_MEM_MAP) {
+		for (mm = (memory_map *) phys_to_virt(mb->mmap_addr); mm < mm_end;
+		     mm = next_memory_map(mm)) {
+			if ((MEMORY_AVAILABLE != mm->type) || (0 != mm->base_hi))
+				continue;
+			unsigned int end = mm->base_lo + mm->length_lo;
+			if ((0 != mm->length_hi) || (end < mm->base_lo))
+				end = PAGE_ADDRESS_MASK;
+			release_frames(mm->base_lo, end);
+		}
 	} else {
-		/*
-		 * Free list is non-empty; take the first entry in the list 
-		 */
-		address = (void *)page_free;
-		page_free = page_free->next;
+		release_frames(PAGE_START, mem_top);
+	}
+
+	kprintf("Memory: %uKb total, %uKb available for paging\n",
+		mem_top / KB, frames_free * (PAGE_SIZE / KB));
+
+	/*
+	 * Build the kernel's page tables: all of physical memory is mapped at
+	 * KERNEL_VIRT_BASE for kernel use only, except for the kernel's executable
+	 * code, which processes are given read-only access to. These mappings are
+	 * the same in every address space, so they are marked global where the
+	 * processor supports it, and survive the TLB flush on each context
+	 * switch. 
+	 */
+	unsigned int global = enable_global_pages() ? PAGE_GLOBAL : 0;
+	kernel_pdir = (page_dir) alloc_zeroed_page();
+	assert(NULL != kernel_pdir);
+	direct_map(0 * MB, (mem_top + PAGE_SIZE - 1) & PAGE_ADDRESS_MASK,
+		   PAGE_SUPERVISOR | global, PAGE_READ_WRITE);
+	direct_map(KERNEL_CODE_START, KERNEL_CODE_END, PAGE_USER | global,
+		   PAGE_READ_ONLY);
+
+	shared_zero_page = (unsigned int)alloc_zeroed_page();
+	assert(0 != shared_zero_page);
+
+	enable_paging(kernel_pdir);
+}
+
+/*
+ * new_page_dir
+ * 
+ * Allocate a page directory for a new process. The kernel's page directory
+ * entries are copied from kernel_pdir, so the page tables for the kernel's part of
+ * the address space are shared rather than duplicated. Returns NULL if there is
+ * no memory available.
+ */
+page_dir new_page_dir(void)
+{
+	page_dir pdir = (page_dir) alloc_zeroed_page();
+	if (NULL == pdir)
+		return NULL;
+
+	page_dir dir = (page_dir) phys_to_virt(pdir);
+	page_dir kdir = (page_dir) phys_to_virt(kernel_pdir);
+	unsigned int dirindex;
+	for (dirindex = 0; dirindex < 1024; dirindex++) {
+		if (kdir[dirindex] & PAGE_PRESENT)
+			dir[dirindex] = kdir[dirindex];
+	}
+	return pdir;
+}
+
+/*
+ * find_free_run
+ * 
+ * Search the frame bitmap for a run of n consecutive free frames, considering
+ * only frames from first onwards. Words of the bitmap which are completely full
+ * are skipped over in one step. Returns frame_count if no such run exists.
+ */
+static unsigned int find_free_run(unsigned int first, unsigned int n)
+{
+	unsigned int run = 0;
+	unsigned int start = 0;
+	unsigned int f = first;
+	while (f < frame_count) {
+		if ((0 == f % 32) && (0xFFFFFFFF == frame_map[f / 32])) {
+			run = 0;
+			f += 32;
+			continue;
+		}
+		if (frame_is_used(f)) {
+			run = 0;
+		} else {
+			if (0 == run)
+				start = f;
+			if (n == ++run)
+				return start;
+		}
+		f++;
+	}
+	return frame_count;
+}
+
+/*
+ * evict_from_range
+ * 
+ * Advance the clock hand through the pages mapped between start and end, looking
+ * for one to swap out (see swap_out_page). Returns 1 if a page was evicted, 0 if
+ * the hand reached the end of the range without finding one, or a negative error
+ * code if eviction failed.
+ */
+static int evict_from_range(page_dir pdir, unsigned int start, unsigned int end)
+{
+	unsigned int addr = start;
+	while (addr < end) {
+		unsigned int stop = table_end(addr);
+		if ((stop > end) || (0 == stop))
+			stop = end;
+
+		page_table ptable = get_table(pdir, addr, 0);
+		if (NULL == ptable) {
+			addr = stop;
+			continue;
+		}
+
+		for (; addr < stop; addr += PAGE_SIZE) {
+			unsigned int *pte = &ptable[(addr / PAGE_SIZE) % 1024];
+			unsigned int page = *pte & PAGE_ADDRESS_MASK;
+			if (!(*pte & PAGE_PRESENT) || (shared_zero_page == page) ||
+			    (page < PAGE_START) ||
+			    (1 != frame_refs[frame_of(page)]))
+				continue;
+
+			if (*pte & PAGE_ACCESSED) {
+				*pte &= ~PAGE_ACCESSED;
+				invalidate_page(addr);
+				continue;
+			}
+
+			unsigned int slot = swap_alloc();
+			if (0 == slot)
+				return -ENOMEM;
+			if (0 != swap_write(slot, page)) {
+				swap_free(slot);
+				return -EIO;
+			}
+			*pte = (slot * PAGE_SIZE) | PAGE_SWAPPED |
+			    (*pte & ~PAGE_ADDRESS_MASK & ~PAGE_PRESENT & ~PAGE_DIRTY);
+			invalidate_page(addr);
+			free_page((void *)page);
+			clock_addr = addr + PAGE_SIZE;
+			return 1;
+		}
 	}
+	return 0;
+}
+
+/*
+ * swap_out_page
+ * 
+ * Evict a page of process memory to the swap disk, to free up a frame. Pages are
+ * chosen with the clock algorithm, which approximates least recently used: the
+ * hand sweeps through the areas of each process in turn, and a page whose
+ * accessed bit is set is given a second chance, by clearing the bit and moving
+ * on. The first page found that has not been accessed since the hand last passed
+ * it is evicted. Only pages that belong to a single process are considered, i.e.
+ * anonymous memory and private copies of file pages. Pages still shared through
+ * copy-on-write or the page cache stay in memory, as do the page tables
+ * themselves. A vfork parent is skipped, since its child is using its address
+ * space, and so is the current process during a system call, since the buffers
+ * the call has faulted in (see vma_fault_in) must stay in memory until it is done
+ * with them.
+ * 
+ * Returns 0 if a page was evicted, -ENOMEM if there is no swap space or nothing
+ * suitable to evict, or -EIO if the swap disk reported an error.
+ */
+static int swap_out_page(void)
+{
+	unsigned int laps = 0;
+
+	if (0 == swap_slots_free)
+		return -ENOMEM;
 
 	/*
-	 * Zero page 
+	 * The scan starts part way through a lap, and the first full lap may do
+	 * nothing but clear accessed bits, so give up after the third
 	 */
+	while (laps < 3) {
+		process *proc = &processes[clock_pid];
+		if (proc->exists && (NULL != proc->pdir) &&
+		    (NULL == proc->vfork_child) &&
+		    !((proc == current_process) && proc->in_syscall)) {
+			vm_area *v;
+			for (v = proc->vmas.first; v; v = v->next) {
+				if (v->end <= clock_addr)
+					continue;
+				unsigned int start =
+				    (v->start > clock_addr) ? v->start : clock_addr;
+				int r = evict_from_range(proc->pdir, start, v->end);
+				if (0 != r)
+					return (0 < r) ? 0 : r;
+			}
+		}
+
+		clock_pid = (clock_pid + 1) % MAX_PROCESSES;
+		clock_addr = 0;
+		if (0 == clock_pid)
+			laps++;
+	}
+	return -ENOMEM;
+}
+
+/*
+ * alloc_pages
+ * 
+ * Allocate n physically contiguous pages, returning the address of the first, or
+ * NULL if there is no free run of memory that large. The search starts at
+ * frame_hint, since everything before it is known to be in use; a single-frame
+ * allocation therefore usually succeeds on the first word it examines. If there
+ * are not enough free frames, pages are swapped out to make up the difference,
+ * although this does not guarantee that they are contiguous.
+ * 
+ * Unlike alloc_page, this does not zero the memory it returns.
+ */
+void *alloc_pages(unsigned int n)
+{
+	assert(0 < n);
+	while ((n > frames_free) && (0 == swap_out_page())) ;
+	if (n > frames_free) {
+		kprintf("Out of physical memory (%u pages requested)\n", n);
+		return NULL;
+	}
+
+	unsigned int f = find_free_run(frame_hint * 32, n);
+	if (f >= frame_count) {
+		kprintf("Out of contiguous physical memory (%u pages)\n", n);
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		set_frame_used(f + i);
+		frame_refs[f + i] = 1;
+	}
+	frames_free -= n;
+	frames_used += n;
+
+	while ((frame_hint * 32 < frame_count) &&
+	       (0xFFFFFFFF == frame_map[frame_hint]))
+		frame_hint++;
+
+	return (void *)frame_addr(f);
+}
+
+/*
+ * free_pages
+ * 
+ * Return n contiguous pages, previously obtained from alloc_pages, to the frame
+ * allocator.
+ */
+void free_pages(void *page, unsigned int n)
+{
+	unsigned int f = frame_of(page);
+	unsigned int i;
+	assert(0 == (unsigned int)page % PAGE_SIZE);
+	assert((unsigned int)page >= PAGE_START);
+	assert(f + n <= frame_count);
+	for (i = 0; i < n; i++) {
+		assert(frame_is_used(f + i));
+		set_frame_free(f + i);
+		frame_refs[f + i] = 0;
+	}
+	frames_free += n;
+	frames_used -= n;
+	if (f / 32 < frame_hint)
+		frame_hint = f / 32;
+}
+
+/*
+ * zero_page
+ * 
+ * Clear the contents of a page
+ */
+static void zero_page(void *address)
+{
+	unsigned int *words = (unsigned int *)phys_to_virt(address);
 	unsigned int i;
 	for (i = 0; i < 1024; i++)
-		((unsigned int *)address)[i] = 0;
+		words[i] = 0;
+}
+
+/*
+ * alloc_page
+ * 
+ * Allocate a single page from the frame allocator. The contents of the page are
+ * undefined; use alloc_zeroed_page if it needs to be cleared. Pages held in the
+ * zero pool are only used as a last resort. Returns NULL if physical memory is
+ * exhausted; callers must check for this and fail the operation that needed the
+ * page, rather than walking off the end of RAM.
+ */
+void *alloc_page(void)
+{
+	if ((0 == frames_free) && (0 < zero_pool_count))
+		return (void *)zero_pool[--zero_pool_count];
+	return alloc_pages(1);
+}
+
+/*
+ * alloc_zeroed_page
+ * 
+ * Allocate a single page whose contents are all zero. This takes a page from the
+ * pool of pre-zeroed frames if one is available, and only falls back to clearing
+ * a page here if the pool is empty.
+ */
+void *alloc_zeroed_page(void)
+{
+	if (0 < zero_pool_count)
+		return (void *)zero_pool[--zero_pool_count];
+
+	void *address = alloc_pages(1);
+	if (NULL != address)
+		zero_page(address);
 	return address;
 }
 
+/*
+ * refill_zero_pool
+ * 
+ * Zero up to ZERO_POOL_BATCH free frames and add them to the pool used by
+ * alloc_zeroed_page. This is called from context_switch when there are no
+ * processes ready to run, so that the work happens at a time when the CPU would
+ * otherwise just be spinning in the idle loop. The batch size keeps the time
+ * spent here (with interrupts disabled) short.
+ */
+void refill_zero_pool(void)
+{
+	unsigned int n;
+	if (ZERO_POOL_SIZE == zero_pool_count)
+		return;
+
+	for (n = 0; (n < ZERO_POOL_BATCH) && (ZERO_POOL_SIZE > zero_pool_count)
+	     && (0 < frames_free); n++) {
+		void *address = alloc_pages(1);
+		zero_page(address);
+		zero_pool[zero_pool_count++] = (unsigned int)address;
+	}
+}
+
+/*
+ * ref_page
+ * 
+ * Record an additional reference to a page, which is about to be mapped into
+ * another address space. Frames below PAGE_START, such as those of the file
+ * system image which the page cache maps directly, are not managed by the frame
+ * allocator, and are not reference counted.
+ */
+void ref_page(void *page)
+{
+	if ((shared_zero_page == (unsigned int)page) ||
+	    ((unsigned int)page < PAGE_START))
+		return;
+
+	unsigned int f = frame_of(page);
+	assert(frame_is_used(f));
+	assert(255 > frame_refs[f]);
+	frame_refs[f]++;
+}
+
 /*
  * free_page
  * 
- * Indicates that a page is no longer needed, and returns it to the free list. The
- * page will become available for use by subsequent calls to alloc_page().
+ * Indicates that a page is no longer needed by one of its users. Once there are
+ * no references left, it is returned to the frame allocator, and will become
+ * available for use by subsequent calls to alloc_page(). As with ref_page, the
+ * shared zero page and frames below PAGE_START are left alone.
  */
 void free_page(void *page)
 {
-	assert(0 < npages);
-	npages--;
-	freelist *entry = ((freelist *) page);
-	entry->next = page_free;
-	page_free = entry;
+	if ((shared_zero_page == (unsigned int)page) ||
+	    ((unsigned int)page < PAGE_START))
+		return;
+
+	unsigned int f = frame_of(page);
+	assert(0 < frame_refs[f]);
+	if (0 == --frame_refs[f])
+		free_pages(page, 1);
 }
 
 /*
@@ -115,30 +719,24 @@ void free_page(void *page)
  * either PAGE_USER, specifying that user mode code may access the page, or
  * PAGE_SUPERVISOR, indicating that only kernel mode code may access it. The
  * readwrite parameter is either PAGE_READ_WRITE or PAGE_READ_ONLY, which specifies
- * whether user code can write to the page or not. Code running in kernel mode can
- * always write to the page regardless of whether this bit is set or not.
+ * whether the page can be written to or not. Since enable_paging sets the write
+ * protect bit of CR0, this applies to code running in kernel mode as well.
+ * 
+ * If an existing mapping is replaced, its TLB entry is invalidated. Entries that
+ * were not present are never cached, so new mappings need no invalidation.
+ * 
+ * Returns 0 on success, or -ENOMEM if a page table was needed but could not be
+ * allocated.
  */
-void
+int
 map_page(page_dir pdir, unsigned int logical, unsigned int physical,
 	 unsigned int access, unsigned int readwrite)
 {
 	assert(0 == logical % PAGE_SIZE);	/* ensure it's page-aligned */
 	assert(0 == physical % PAGE_SIZE);	/* ensure it's page-aligned */
-	unsigned int pageno = logical / PAGE_SIZE;	/* page # of logical address */
-	unsigned int dirindex = pageno / 1024;	/* index into page directory */
-	unsigned int tblindex = pageno % 1024;	/* index into page table */
-
-	/*
-	 * Get page directory entry, creating if necessary. The permission bits here
-	 * just act as a filter for the entries in the page table, so we can just
-	 * specify full user access here; it's the permission bits in each page table
-	 * entry that really count. 
-	 */
-	if (!(pdir[dirindex] & PAGE_PRESENT)) {
-		unsigned int dirpage = (unsigned int)alloc_page();
-		pdir[dirindex] =
-		    dirpage | PAGE_PRESENT | PAGE_USER | PAGE_READ_WRITE;
-	}
+	unsigned int *pte = get_pte(pdir, logical, 1);
+	if (NULL == pte)
+		return -ENOMEM;
 
 	/*
 	 * Add/replace the page table entry. The value we set combines the top 20 bits
@@ -146,8 +744,11 @@ map_page(page_dir pdir, unsigned int logical, unsigned int physical,
 	 * that this mapping exists. The page address always has its bottom 12 bits as
 	 * 0, since it is a multiple of 2^12 = 4096. 
 	 */
-	page_table ptable = (page_table) (pdir[dirindex] & PAGE_ADDRESS_MASK);
-	ptable[tblindex] = physical | PAGE_PRESENT | access | readwrite;
+	int replaced = (*pte & PAGE_PRESENT);
+	*pte = physical | PAGE_PRESENT | access | readwrite;
+	if (replaced)
+		invalidate_page(logical);
+	return 0;
 }
 
 /*
@@ -159,75 +760,302 @@ map_page(page_dir pdir, unsigned int logical, unsigned int physical,
 int lookup_page(page_dir pdir, unsigned int logical, unsigned int *phys)
 {
 	assert(0 == logical % PAGE_SIZE);	/* ensure it's page-aligned */
-	unsigned int pageno = logical / PAGE_SIZE;	/* page # of logical address */
-	unsigned int dirindex = pageno / 1024;	/* index into page directory */
-	unsigned int tblindex = pageno % 1024;	/* index into page table */
-
-	if (!(pdir[dirindex] & PAGE_PRESENT))
-		return 0;
-
-	page_table ptable = (page_table) (pdir[dirindex] & PAGE_ADDRESS_MASK);
-	if (!(ptable[tblindex] & PAGE_PRESENT))
+	unsigned int *pte = get_pte(pdir, logical, 0);
+	if ((NULL == pte) || !(*pte & PAGE_PRESENT))
 		return 0;
-	*phys = (ptable[tblindex] & PAGE_ADDRESS_MASK);
+	*phys = (*pte & PAGE_ADDRESS_MASK);
 	return 1;
 }
 
+/*
+ * clear_pte
+ * 
+ * Remove a page table entry, invalidating its TLB entry if it was present, and
+ * release the frame or swap slot that it refers to
+ */
+static void clear_pte(unsigned int *pte, unsigned int logical)
+{
+	if (*pte & PAGE_PRESENT) {
+		unsigned int page = (*pte & PAGE_ADDRESS_MASK);
+		*pte = 0;
+		invalidate_page(logical);
+		free_page((void *)page);
+	} else if (*pte & PAGE_SWAPPED) {
+		swap_free(swap_slot(*pte));
+		*pte = 0;
+	}
+}
+
 /*
  * unmap_and_free_page
  * 
- * Remove a page mapping, and free the physical page associated with it.
+ * Remove a page mapping, invalidate its TLB entry, and free the physical page
+ * associated with it, or its swap slot if it has been swapped out.
  */
 void unmap_and_free_page(page_dir pdir, unsigned int logical)
 {
 	assert(0 == logical % PAGE_SIZE);	/* ensure it's page-aligned */
-	unsigned int pageno = logical / PAGE_SIZE;	/* page # of logical address */
-	unsigned int dirindex = pageno / 1024;	/* index into page directory */
-	unsigned int tblindex = pageno % 1024;	/* index into page table */
+	unsigned int *pte = get_pte(pdir, logical, 0);
+	if (NULL != pte)
+		clear_pte(pte, logical);
+}
 
-	if (!(pdir[dirindex] & PAGE_PRESENT))
-		return;
+/*
+ * map_range
+ * 
+ * Map the logical addresses from start to end onto consecutive physical pages
+ * starting at physical, with the specified permissions (see map_page). Each page
+ * table is looked up once, rather than once per page. Returns -ENOMEM if a page
+ * table could not be allocated, in which case the pages mapped so far remain
+ * mapped.
+ */
+int
+map_range(page_dir pdir, unsigned int start, unsigned int end,
+	  unsigned int physical, unsigned int access, unsigned int readwrite)
+{
+	assert(0 == start % PAGE_SIZE);
+	assert(0 == physical % PAGE_SIZE);
+	unsigned int addr = start;
+	while (addr < end) {
+		page_table ptable = get_table(pdir, addr, 1);
+		if (NULL == ptable)
+			return -ENOMEM;
 
-	page_table ptable = (page_table) (pdir[dirindex] & PAGE_ADDRESS_MASK);
-	if (!(ptable[tblindex] & PAGE_PRESENT))
-		return;
-	unsigned int page = (ptable[tblindex] & PAGE_ADDRESS_MASK);
-	free_page((void *)page);
-	ptable[tblindex] = 0;
+		unsigned int stop = table_end(addr);
+		if ((stop > end) || (0 == stop))
+			stop = end;
+		for (; addr < stop; addr += PAGE_SIZE, physical += PAGE_SIZE) {
+			unsigned int *pte = &ptable[(addr / PAGE_SIZE) % 1024];
+			int replaced = (*pte & PAGE_PRESENT);
+			*pte = physical | PAGE_PRESENT | access | readwrite;
+			if (replaced)
+				invalidate_page(addr);
+		}
+	}
+	return 0;
 }
 
 /*
- * identity_map
+ * unmap_range
  * 
- * Set up a page table entry that maps the specified logical address to the same
- * physical address. This is needed for certain important regions of physical
- * memory to remain accessible when paging is enabled, in particular the kernel
- * memory that system calls need to access.
+ * Remove all of the mappings between start and end, invalidating their TLB
+ * entries and freeing the pages or swap slots they refer to, as
+ * unmap_and_free_page does for a single page. Parts of the range with no page
+ * table are skipped a whole table at a time, and page tables left empty are
+ * released.
  */
-void
-identity_map(page_dir pdir, unsigned int start, unsigned int end,
-	     unsigned int access, unsigned int readwrite)
+void unmap_range(page_dir pdir, unsigned int start, unsigned int end)
 {
-	unsigned int addr;
-	for (addr = start; addr < end; addr += PAGE_SIZE)
-		map_page(pdir, addr, addr, access, readwrite);
+	assert(0 == start % PAGE_SIZE);
+	unsigned int addr = start;
+	while (addr < end) {
+		unsigned int stop = table_end(addr);
+		if ((stop > end) || (0 == stop))
+			stop = end;
+
+		page_table ptable = get_table(pdir, addr, 0);
+		if (NULL == ptable) {
+			addr = stop;
+			continue;
+		}
+
+		unsigned int table = addr;
+		for (; addr < stop; addr += PAGE_SIZE)
+			clear_pte(&ptable[(addr / PAGE_SIZE) % 1024], addr);
+		free_table_if_empty(pdir, table);
+	}
 }
 
 /*
- * map_new_pages
+ * copy_range
  * 
- * Allocates a certain number of new pages, and sets up mappings to them starting
- * at the specified base address.
+ * Share the pages mapped in one page directory between the specified addresses
+ * with another page directory, for copy-on-write. Each page is made read-only in
+ * both, and marked with PAGE_COW so that a write to it results in a call to
+ * copy_on_write rather than an error. The source's TLB entries are invalidated
+ * for each page that was writable. Pages which have been swapped out stay that
+ * way, and the destination gets its own reference to the swap slot. Page tables
+ * are walked a whole table at a time, and parts of the range with no page table
+ * in the source are skipped. Returns -ENOMEM if a page table could not be
+ * allocated in the destination, in which case the pages shared so far remain
+ * mapped there.
  */
-void map_new_pages(page_dir pdir, unsigned int base, unsigned int npages)
+int
+copy_range(page_dir src, page_dir dest, unsigned int start, unsigned int end)
 {
-	assert(0 == base % PAGE_SIZE);
-	unsigned int i;
-	for (i = 0; i < npages; i++) {
-		unsigned int page = (unsigned int)alloc_page();
-		map_page(pdir, base + i * PAGE_SIZE, page, PAGE_USER,
-			 PAGE_READ_WRITE);
+	assert(0 == start % PAGE_SIZE);
+	unsigned int addr = start;
+	while (addr < end) {
+		unsigned int stop = table_end(addr);
+		if ((stop > end) || (0 == stop))
+			stop = end;
+
+		page_table srctable = get_table(src, addr, 0);
+		page_table desttable = NULL;
+		if (NULL == srctable) {
+			addr = stop;
+			continue;
+		}
+
+		for (; addr < stop; addr += PAGE_SIZE) {
+			unsigned int index = (addr / PAGE_SIZE) % 1024;
+			if (!(srctable[index] & (PAGE_PRESENT | PAGE_SWAPPED)))
+				continue;
+
+			/*
+			 * Allocating the table may swap pages out, so the entry is
+			 * only read once it has been obtained
+			 */
+			if ((NULL == desttable) &&
+			    (NULL == (desttable = get_table(dest, addr, 1))))
+				return -ENOMEM;
+
+			unsigned int pte = srctable[index];
+			if (!(pte & PAGE_PRESENT)) {
+				swap_dup(swap_slot(pte));
+				desttable[index] = pte;
+				continue;
+			}
+
+			if (pte & PAGE_READ_WRITE) {
+				pte = (pte & ~PAGE_READ_WRITE) | PAGE_COW;
+				srctable[index] = pte;
+				invalidate_page(addr);
+			}
+
+			unsigned int page = pte & PAGE_ADDRESS_MASK;
+			desttable[index] = page | PAGE_PRESENT |
+			    (pte & (PAGE_USER | PAGE_COW)) | PAGE_READ_ONLY;
+			ref_page((void *)page);
+		}
+	}
+	return 0;
+}
+
+/*
+ * copy_on_write
+ * 
+ * Handle a write to a copy-on-write page. If the page is still shared with
+ * another address space, a private copy is made and mapped in its place;
+ * otherwise the existing page is simply made writable again. The shared zero page
+ * is always replaced by a freshly zeroed one, and a frame of the file system
+ * image by a copy. This is called from the page fault handler. Returns 0 if the
+ * fault was handled, -EFAULT if the page is not a copy-on-write page, or -ENOMEM
+ * if a copy could not be made.
+ */
+int copy_on_write(page_dir pdir, unsigned int logical)
+{
+	logical &= PAGE_ADDRESS_MASK;
+	unsigned int *pte = get_pte(pdir, logical, 0);
+	if ((NULL == pte) || !(*pte & PAGE_PRESENT) || !(*pte & PAGE_COW))
+		return -EFAULT;
+
+	unsigned int page = *pte & PAGE_ADDRESS_MASK;
+	if (shared_zero_page == page) {
+		void *copy = alloc_zeroed_page();
+		if (NULL == copy)
+			return -ENOMEM;
+		page = (unsigned int)copy;
+	} else if ((page < PAGE_START) || (1 < frame_refs[frame_of(page)])) {
+		void *copy = alloc_page();
+		if (NULL == copy)
+			return -ENOMEM;
+		copy_page((unsigned int)copy, page);
+		free_page((void *)page);
+		page = (unsigned int)copy;
+	}
+	*pte = page | (*pte & ~PAGE_ADDRESS_MASK & ~PAGE_COW) | PAGE_READ_WRITE;
+	invalidate_page(logical);
+	return 0;
+}
+
+/*
+ * swap_in_page
+ * 
+ * Read a page that has been swapped out back into memory, and map it with the
+ * permissions it had before. The process gets a private copy of the page, even
+ * if the swap slot is shared with other processes as a result of fork. This is
+ * called from vma_fault, either for a page fault or for a buffer a system call
+ * is about to use, in which case an error fails the system call. Returns 0 if the
+ * page was read in, -EFAULT if it has not been swapped out, -ENOMEM if there was
+ * not enough memory, or -EIO if the swap disk reported an error.
+ */
+int swap_in_page(page_dir pdir, unsigned int logical)
+{
+	logical &= PAGE_ADDRESS_MASK;
+	unsigned int *pte = get_pte(pdir, logical, 0);
+	if ((NULL == pte) || !(*pte & PAGE_SWAPPED))
+		return -EFAULT;
+
+	void *page = alloc_page();
+	if (NULL == page)
+		return -ENOMEM;
+	unsigned int slot = swap_slot(*pte);
+	if (0 != swap_read(slot, (unsigned int)page)) {
+		free_page(page);
+		return -EIO;
 	}
+	*pte = (unsigned int)page | (*pte & ~PAGE_ADDRESS_MASK & ~PAGE_SWAPPED) |
+	    PAGE_PRESENT;
+	swap_free(slot);
+	return 0;
+}
+
+/*
+ * map_demand_zero
+ * 
+ * Provide a page for demand-zero memory, i.e. part of a process's data or stack
+ * segment that has never been accessed before. For a write, a newly zeroed page
+ * is mapped. For a read, the shared zero page is mapped copy-on-write instead, so
+ * that memory which is only ever read never costs a frame of its own. Like
+ * copy_on_write, this is called from the page fault handler. Returns -ENOMEM if
+ * there was not enough memory.
+ */
+int map_demand_zero(page_dir pdir, unsigned int logical, int write)
+{
+	logical &= PAGE_ADDRESS_MASK;
+	if (!write)
+		return map_page(pdir, logical, shared_zero_page,
+				PAGE_USER | PAGE_COW, PAGE_READ_ONLY);
+
+	void *page = alloc_zeroed_page();
+	if (NULL == page)
+		return -ENOMEM;
+	int r = map_page(pdir, logical, (unsigned int)page, PAGE_USER,
+			 PAGE_READ_WRITE);
+	if (0 != r)
+		free_page(page);
+	return r;
+}
+
+/*
+ * map_copy
+ * 
+ * Map a new page at a logical address which has nothing mapped there yet, filled
+ * with a page of data from the current address space, or with zeroes if data is
+ * NULL. This is how a pager supplies the pages of a region it manages (see
+ * mmap.c). Returns -EINVAL if there is already a page at the address, including
+ * one that has been swapped out, or -ENOMEM if there was not enough memory.
+ */
+int
+map_copy(page_dir pdir, unsigned int logical, const void *data,
+	 unsigned int readwrite)
+{
+	logical &= PAGE_ADDRESS_MASK;
+	unsigned int *pte = get_pte(pdir, logical, 0);
+	if ((NULL != pte) && (*pte & (PAGE_PRESENT | PAGE_SWAPPED)))
+		return -EINVAL;
+
+	void *page = (NULL == data) ? alloc_zeroed_page() : alloc_page();
+	if (NULL == page)
+		return -ENOMEM;
+	if (NULL != data)
+		fill_page((unsigned int)page, data, PAGE_SIZE);
+	int r = map_page(pdir, logical, (unsigned int)page, PAGE_USER,
+			 readwrite);
+	if (0 != r)
+		free_page(page);
+	return r;
 }
 
 /*
@@ -236,15 +1064,21 @@ void map_new_pages(page_dir pdir, unsigned int base, unsigned int npages)
  * Frees the memory associated with a page directory and its page tables. This does
  * *not* free the pages referred to by the page table entries, since some of them
  * may be in parts of memory that are not managed by the page allocator, e.g. the
- * code or data used by the kernel.
+ * code or data used by the kernel. The kernel's page tables are shared with
+ * kernel_pdir, and are left alone. The page directory must not be the current
+ * one.
  */
 void free_page_dir(page_dir pdir)
 {
+	page_dir dir = (page_dir) phys_to_virt(pdir);
+	page_dir kdir = (page_dir) phys_to_virt(kernel_pdir);
 	unsigned int dirindex;
 	for (dirindex = 0; dirindex < 1024; dirindex++) {
-		if (pdir[dirindex] & PAGE_PRESENT) {
+		if (kdir[dirindex] & PAGE_PRESENT)
+			continue;
+		if (dir[dirindex] & PAGE_PRESENT) {
 			unsigned int page_addr =
-			    pdir[dirindex] & PAGE_ADDRESS_MASK;
+			    dir[dirindex] & PAGE_ADDRESS_MASK;
 			free_page((void *)page_addr);
 		}
 	}
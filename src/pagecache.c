@@ -0,0 +1,143 @@
+/*
+ *      pagecache.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+extern char *filesystem;
+
+/*
+ * Page cache
+ *
+ * The text segment of a program, and any file mapped with mmap, is read in from
+ * the file one page at a time, as the process touches each page. The pages read
+ * in are kept in a cache belonging to the file, so that every process using the
+ * same file maps the same frames, instead of each having a copy of its own.
+ *
+ * The file system image already sits in memory, so wherever a whole page of a
+ * file lies on a page boundary in the image, the frame it occupies is used as
+ * the cached page directly, and nothing is copied at all. fstool lays out the
+ * image so that this is the case for every page of a file except a partial last
+ * one. Other pages are copied into newly allocated frames, with the part beyond
+ * the end of the file cleared.
+ *
+ * Cached pages are mapped read-only and copy-on-write. Flat binaries keep their
+ * data and bss in the same segment as their code, so a process that writes to a
+ * page is given a private copy of it by copy_on_write, while the code and
+ * read-only data stay shared between everyone running the program.
+ *
+ * The cache holds a reference to each frame in it that it allocated, in
+ * addition to those held by the page tables mapping it, so a shared page is
+ * never made writable in place; frames of the image are never written to or
+ * freed at all. The pages for a file are released once the last process using
+ * it has unmapped it, exited or execed something else.
+ */
+
+static cached_filelist cached_files = { first: NULL, last:NULL };
+
+/*
+ * pagecache_get
+ *
+ * Find the cache for a file, creating one if no other process is using the file,
+ * and record the calling process as one of its users
+ */
+cached_file *pagecache_get(directory_entry * entry)
+{
+	cached_file *cf;
+	for (cf = cached_files.first; cf; cf = cf->next) {
+		if (cf->entry == entry) {
+			cf->users++;
+			return cf;
+		}
+	}
+
+	unsigned int npages = (entry->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	cf = (cached_file *) kmalloc(sizeof(cached_file) +
+				     npages * sizeof(unsigned int));
+	cf->prev = NULL;
+	cf->next = NULL;
+	cf->entry = entry;
+	cf->users = 1;
+	cf->npages = npages;
+	cf->pages = (unsigned int *)(cf + 1);
+	memset(cf->pages, 0, npages * sizeof(unsigned int));
+	list_add(&cached_files, cf);
+	return cf;
+}
+
+/*
+ * pagecache_put
+ *
+ * Indicate that a process is no longer using a file. When there are no users
+ * left, the cached pages are released, along with the cache itself.
+ */
+void pagecache_put(cached_file * cf)
+{
+	if ((NULL == cf) || (0 < --cf->users))
+		return;
+
+	unsigned int i;
+	for (i = 0; i < cf->npages; i++) {
+		if (0 != cf->pages[i])
+			free_page((void *)cf->pages[i]);
+	}
+	list_remove(&cached_files, cf);
+	kfree(cf);
+}
+
+/*
+ * pagecache_map
+ *
+ * Map the page of a file at the specified offset into a process's address space,
+ * reading it in from the file system if it is not already in the cache. For a
+ * read, the cached page itself is mapped copy-on-write. For a write, there is no
+ * point sharing it only to copy it straight afterwards, so a private copy is
+ * mapped right away. This is called from the page fault handler. Returns -EFAULT
+ * if the offset is beyond the end of the file, or -ENOMEM if there was not
+ * enough memory.
+ */
+int
+pagecache_map(page_dir pdir, unsigned int logical, cached_file * cf,
+	      unsigned int offset, int write)
+{
+	unsigned int index = offset / PAGE_SIZE;
+	int r = -ENOMEM;
+	if (index >= cf->npages)
+		return -EFAULT;
+
+	if (0 == cf->pages[index]) {
+		char *data = filesystem + cf->entry->location + offset;
+		if ((0 == (unsigned int)data % PAGE_SIZE) &&
+		    (offset + PAGE_SIZE <= cf->entry->size)) {
+			cf->pages[index] = virt_to_phys(data);
+		} else {
+			void *page = alloc_page();
+			if (NULL != page) {
+				fill_page((unsigned int)page, data,
+					  cf->entry->size - offset);
+				cf->pages[index] = (unsigned int)page;
+			}
+		}
+	}
+
+	unsigned int page = cf->pages[index];
+	if ((0 != page) && write) {
+		void *copy = alloc_page();
+		if (NULL != copy) {
+			copy_page((unsigned int)copy, page);
+			r = map_page(pdir, logical & PAGE_ADDRESS_MASK,
+				     (unsigned int)copy, PAGE_USER,
+				     PAGE_READ_WRITE);
+			if (0 != r)
+				free_page(copy);
+		}
+	} else if (0 != page) {
+		r = map_page(pdir, logical & PAGE_ADDRESS_MASK, page,
+			     PAGE_USER | PAGE_COW, PAGE_READ_ONLY);
+		if (0 == r)
+			ref_page((void *)page);
+	}
+	return r;
+}
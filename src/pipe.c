@@ -9,6 +9,12 @@
 extern process *current_process;
 extern process processes[MAX_PROCESSES];
 
+/*
+ * Pipe buffers are allocated from their own object cache 
+ */
+static kmem_cache pipe_cache =
+    KMEM_CACHE("pipe_buffer", sizeof(pipe_buffer), NULL);
+
 /*
  * new_pipe
  * 
@@ -17,7 +23,7 @@ extern process processes[MAX_PROCESSES];
  */
 pipe_buffer *new_pipe(void)
 {
-	pipe_buffer *b = kmalloc(sizeof(pipe_buffer));
+	pipe_buffer *b = kmem_cache_alloc(&pipe_cache);
 	b->reading = 1;
 	b->writing = 1;
 	b->readpid = -1;
@@ -66,17 +72,12 @@ void write_to_pipe(pipe_buffer * b, const void *buf, size_t count)
 {
 	if (b->len + count > b->alloc) {
 		/*
-		 * More data needs to be written that we have room for; resize the array 
+		 * More data needs to be written that we have room for; resize the
+		 * array. This can usually be done in place without copying. 
 		 */
 		while (b->len + count > b->alloc)
 			b->alloc *= 2;
-		/*
-		 * This would be slightly simpler if we had realloc(), but we don't 
-		 */
-		char *newdata = kmalloc(b->alloc);
-		memmove(newdata, b->data, b->len);
-		kfree(b->data);
-		b->data = newdata;
+		b->data = krealloc(b->data, b->alloc);
 	}
 
 	/*
@@ -104,7 +105,7 @@ static void check_buffer_free(pipe_buffer * b)
 	if (!b->reading && !b->writing) {
 		assert(-1 == b->readpid);
 		kfree(b->data);
-		kfree(b);
+		kmem_cache_free(&pipe_cache, b);
 	}
 }
 
@@ -154,7 +155,7 @@ static void pipe_writer_destroy(filehandle * fh)
 	fh->p->writing = 0;
 	wake_up_reader(fh->p);
 	check_buffer_free(fh->p);
-	kfree(fh);
+	kmem_cache_free(&filehandle_cache, fh);
 }
 
 /*
@@ -177,7 +178,7 @@ static void pipe_writer_destroy(filehandle * fh)
  */
 filehandle *new_pipe_writer(pipe_buffer * p)
 {
-	filehandle *fh = (filehandle *) kmalloc(sizeof(filehandle));
+	filehandle *fh = (filehandle *) kmem_cache_alloc(&filehandle_cache);
 	fh->type = FH_PIPE_WRITER;
 	fh->p = p;
 	fh->refcount = 1;
@@ -266,7 +267,7 @@ static void pipe_reader_destroy(filehandle * fh)
 	assert(fh->p->reading);
 	fh->p->reading = 0;
 	check_buffer_free(fh->p);
-	kfree(fh);
+	kmem_cache_free(&filehandle_cache, fh);
 }
 
 /*
@@ -281,7 +282,7 @@ static void pipe_reader_destroy(filehandle * fh)
  */
 filehandle *new_pipe_reader(pipe_buffer * p)
 {
-	filehandle *fh = (filehandle *) kmalloc(sizeof(filehandle));
+	filehandle *fh = (filehandle *) kmem_cache_alloc(&filehandle_cache);
 	fh->type = FH_PIPE_READER;
 	fh->p = p;
 	fh->refcount = 1;
@@ -311,8 +312,9 @@ int syscall_pipe(int filedes[2])
 	/*
 	 * Ensure the supplied array is within the process's address space 
 	 */
-	if (!valid_pointer(filedes, 2 * sizeof(int)))
-		return -EFAULT;
+	int r = valid_write_pointer(filedes, 2 * sizeof(int));
+	if (0 != r)
+		return r;
 
 	/*
 	 * Find two unused file descriptors 
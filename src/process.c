@@ -28,30 +28,185 @@ unsigned int next_pid = 0;
 process *current_process = NULL;
 
 /*
- * We store two (doubly-linked) lists of processes: The ready list
- * contains all the processes that have work that can be done
- * immediately, and are thus eligible for selection by the
- * scheduler. The suspended list is those processes which are waiting
- * for something to happen before they can continue, such as user input
- * becoming availbale.
+ * Processes which have work that can be done immediately, and are thus
+ * eligible for selection by the scheduler, are kept in run queues, one for each
+ * priority level. A process's priority comes from its nice value, from NICE_MIN
+ * (highest priority, queue 0) to NICE_MAX. A bitmap records which queues are
+ * non-empty, so the scheduler can find the highest priority ready process in
+ * constant time, however many processes there are.
+ * 
+ * Each process gets a time slice, which is longer the higher its priority. When
+ * it has used up its slice, it moves to a second, expired, set of run queues,
+ * with a new slice. Once every ready process has used up its slice, the two sets
+ * swap over. This way a lower priority process still gets to run in each round,
+ * just for less time, and a process which spends most of its time waiting for
+ * input, like the shell, is resumed into the active queues with the rest of its
+ * slice, ahead of the CPU-bound processes that have already expired.
+ * 
+ * The suspended list is those processes which are waiting for something to
+ * happen before they can continue, such as user input becoming available.
+ */
+#define PRIORITY_LEVELS  (NICE_MAX - NICE_MIN + 1)
+#define PRIORITY_WORDS   ((PRIORITY_LEVELS + 31) / 32)
+
+typedef struct runqueue {
+	unsigned int bitmap[PRIORITY_WORDS];	/* set bit: queue non-empty */
+	processlist queue[PRIORITY_LEVELS];
+} runqueue;
+
+static runqueue runqueues[2];
+static runqueue *active = &runqueues[0];
+static runqueue *expired = &runqueues[1];
+
+processlist suspended = { first: NULL, last:NULL };
+
+/*
+ * time_slice
+ * 
+ * Length of a time slice for a nice value, in timer ticks: 10 ticks (200ms) at
+ * NICE_MIN, 5 at the default of 0, and 1 at NICE_MAX
+ */
+static unsigned int time_slice(int nice)
+{
+	unsigned int ticks = (NICE_MAX + 1 - nice) / 4;
+	return (0 < ticks) ? ticks : 1;
+}
+
+/*
+ * enqueue
+ * 
+ * Add a process to the end of the run queue for its priority
  */
- processlist ready = { first: NULL, last:NULL };
- processlist suspended = { first: NULL, last:NULL };
+static void enqueue(runqueue * rq, process * proc)
+{
+	unsigned int prio = proc->nice - NICE_MIN;
+	list_append(&rq->queue[prio], proc);
+	rq->bitmap[prio / 32] |= (1 << (prio % 32));
+	proc->rq = rq;
+}
 
 /*
- * These external variables correspond to symbols defined by the linker,
- * which tell us where the kernel's code and data sections begin and
- * end. We use these when setting up paging so that user-level processes
- * are given access to the kernel's code, but not its data.
+ * dequeue
+ * 
+ * Remove a process from the run queue it is in
  */
-extern const unsigned int code;
-extern const unsigned int data;
-extern const unsigned int end;
+static void dequeue(process * proc)
+{
+	runqueue *rq = proc->rq;
+	unsigned int prio = proc->nice - NICE_MIN;
+	list_remove(&rq->queue[prio], proc);
+	if (NULL == rq->queue[prio].first)
+		rq->bitmap[prio / 32] &= ~(1 << (prio % 32));
+	proc->rq = NULL;
+}
 
-#define KERNEL_CODE_START    ((unsigned int)&code)
-#define KERNEL_CODE_END      ((unsigned int)&data)
-#define KERNEL_GLOBALS_START ((unsigned int)&data)
-#define KERNEL_GLOBALS_END   ((unsigned int)&end)
+/*
+ * highest_priority
+ * 
+ * Find the highest priority non-empty queue in a set of run queues, using the
+ * bitmap. Returns -1 if they are all empty.
+ */
+static int highest_priority(runqueue * rq)
+{
+	unsigned int i;
+	for (i = 0; i < PRIORITY_WORDS; i++) {
+		if (0 != rq->bitmap[i])
+			return i * 32 + __builtin_ctz(rq->bitmap[i]);
+	}
+	return -1;
+}
+
+/*
+ * ready_process
+ * 
+ * Make a new or resumed process eligible for execution, by adding it to the
+ * active run queue for its priority. A process that used up its time slice
+ * before it was suspended starts a new one.
+ */
+void ready_process(process * proc)
+{
+	proc->ready = 1;
+	if (0 == proc->ticks_left)
+		proc->ticks_left = time_slice(proc->nice);
+	enqueue(active, proc);
+}
+
+/*
+ * set_nice
+ * 
+ * Change a process's nice value, limiting it to the range NICE_MIN to NICE_MAX.
+ * If the process is ready, it moves to the end of the queue for its new
+ * priority, and its time slice is cut short if the new one is shorter.
+ */
+static void set_nice(process * proc, int nice)
+{
+	if (NICE_MIN > nice)
+		nice = NICE_MIN;
+	if (NICE_MAX < nice)
+		nice = NICE_MAX;
+
+	runqueue *rq = proc->rq;
+	if (proc->ready)
+		dequeue(proc);
+	proc->nice = nice;
+	if (proc->ticks_left > time_slice(nice))
+		proc->ticks_left = time_slice(nice);
+	if (proc->ready)
+		enqueue(rq, proc);
+}
+
+/*
+ * syscall_nice
+ * 
+ * Add inc to the calling process's nice value. A positive increment lowers its
+ * priority, and a negative one raises it. Returns 0; unlike the POSIX function,
+ * the new value is not returned, since a negative result would be taken as an
+ * error.
+ */
+int syscall_nice(int inc)
+{
+	if (inc < NICE_MIN - NICE_MAX)
+		inc = NICE_MIN - NICE_MAX;
+	if (inc > NICE_MAX - NICE_MIN)
+		inc = NICE_MAX - NICE_MIN;
+	set_nice(current_process, current_process->nice + inc);
+	return 0;
+}
+
+/*
+ * syscall_setpriority
+ * 
+ * Set the nice value of any process. Values out of range are limited to
+ * NICE_MIN or NICE_MAX.
+ */
+int syscall_setpriority(pid_t pid, int nice)
+{
+	if ((0 > pid) || (MAX_PROCESSES <= pid) || !processes[pid].exists ||
+	    processes[pid].exited)
+		return -ESRCH;
+	set_nice(&processes[pid], nice);
+	return 0;
+}
+
+/*
+ * scheduler_tick
+ * 
+ * Charge the current process for a timer tick. When it has used up its time
+ * slice, it moves to the expired run queues, with a new slice for next time.
+ */
+void scheduler_tick(void)
+{
+	process *proc = current_process;
+	if ((NULL == proc) || !proc->ready)
+		return;
+	if (0 < proc->ticks_left)
+		proc->ticks_left--;
+	if (0 == proc->ticks_left) {
+		dequeue(proc);
+		proc->ticks_left = time_slice(proc->nice);
+		enqueue(expired, proc);
+	}
+}
 
 /*
  * init_regs
@@ -152,37 +307,29 @@ pid_t start_process(void (*start_address) (void))
 	proc->pid = pid;
 	proc->exists = 1;
 
-	proc->stack_start = PROCESS_STACK_BASE - PROCESS_STACK_SIZE;
-	proc->stack_end = PROCESS_STACK_BASE;
-
-	/*
-	 * Set up initial page mappings 
-	 */
-	proc->pdir = (page_dir) alloc_page();
-
 	/*
-	 * Identity map memory 0-6Mb, for kernel use only 
+	 * Set up initial page mappings. The new page directory already
+	 * contains the kernel's mappings, which give the process read-only
+	 * access to the kernel's executable code. 
 	 */
-	identity_map(proc->pdir, 0 * MB, 6 * MB, PAGE_SUPERVISOR,
-		     PAGE_READ_ONLY);
-
-	/*
-	 * Give the process read-only access to the kernel's executable code 
-	 */
-	identity_map(proc->pdir, KERNEL_CODE_START, KERNEL_CODE_END,
-		     PAGE_USER, PAGE_READ_ONLY);
+	proc->pdir = new_page_dir();
+	if (NULL == proc->pdir) {
+		proc->exists = 0;
+		return -1;
+	}
 
 	/*
-	 * Set up some space for the stack 
+	 * The stack is demand-zero, so no pages are mapped for it yet. It starts
+	 * out PROCESS_STACK_SIZE bytes long, and grows downwards when a page fault
+	 * occurs below it, up to PROCESS_STACK_MAX minus the guard region. The
+	 * data segment starts out empty, and there is no text segment until the
+	 * process calls execve. 
 	 */
-	map_new_pages(proc->pdir, proc->stack_start,
-		      (proc->stack_end - proc->stack_start) / PAGE_SIZE);
+	vma_add(proc, PROCESS_DATA_BASE, PROCESS_DATA_BASE,
+		PROT_READ | PROT_WRITE, VMA_DATA);
+	vma_add(proc, PROCESS_STACK_BASE - PROCESS_STACK_SIZE,
+		PROCESS_STACK_BASE, PROT_READ | PROT_WRITE, VMA_STACK);
 
-	proc->data_start = PROCESS_DATA_BASE;
-	proc->data_end = PROCESS_DATA_BASE;
-
-	proc->text_start = PROCESS_TEXT_BASE;
-	proc->text_end = PROCESS_TEXT_BASE;
 	proc->parent_pid = -1;
 	proc->waiting_on = -1;
 	proc->exit_status = 255;
@@ -200,35 +347,65 @@ pid_t start_process(void (*start_address) (void))
 	/*
 	 * Initialise registers 
 	 */
-	init_regs(&proc->saved_regs, proc->stack_end, start_address);
+	init_regs(&proc->saved_regs, PROCESS_STACK_BASE, start_address);
 
 	/*
 	 * Add this process to the list of ready processes 
 	 */
-	proc->ready = 1;
-	list_add(&ready, proc);
+	ready_process(proc);
 	return pid;
 }
 
+/*
+ * free_process_memory
+ * 
+ * Release all of the areas in a process's address space along with their pages,
+ * as well as its page directory. The page directory must not be the current one.
+ */
+void free_process_memory(process * proc)
+{
+	vma_clear(proc, 0);
+	free_page_dir(proc->pdir);
+	proc->pdir = NULL;
+}
+
 /*
  * kill_process
  * 
- * Stop a running process and removes it from memory. We can't actually
- * free the memory here, since we don't have a free function yet, but
- * this is where you would do it.
+ * Stop a running process and removes it from memory. If the process is the
+ * current one, the kernel's page directory is left active on return.
  */
 void kill_process(process * proc)
 {
+	/*
+	 * A child created by vfork is running in our address space, which is
+	 * about to go away, so it has to die first
+	 */
+	if (NULL != proc->vfork_child)
+		kill_process(proc->vfork_child);
+
+	/*
+	 * Processes waiting for pages from this one will never get them
+	 */
+	proc->pager_wait = 0;
+	vma_pager_exit(proc);
+
 	int current = (current_process == proc);
 
-	disable_paging();
+	/*
+	 * If we are killing the current process, stop using its page directory
+	 * before it is freed. The kernel's page directory is valid no matter
+	 * which process runs next. 
+	 */
+	if (current)
+		enable_paging(kernel_pdir);
 
 	if (current_process == proc)
 		current_process = NULL;
 
 	if (proc->ready)
-		list_remove(&ready, proc)
-		    else
+		dequeue(proc);
+	else
 		list_remove(&suspended, proc);
 
 	int i;
@@ -237,28 +414,22 @@ void kill_process(process * proc)
 			close_filehandle(proc->filedesc[i]);
 	}
 
+	if (MAILBOX_SIZE == proc->mailbox_alloc)
+		kmem_cache_free(&mailbox_cache, proc->mailbox);
+	else
+		kfree(proc->mailbox);
+	proc->mailbox = NULL;
+	proc->mailbox_alloc = 0;
+	proc->mailbox_size = 0;
+
 	/*
-	 * Free all memory associated with this process 
+	 * Free all memory associated with this process. If it was borrowed from
+	 * the parent by vfork, it is handed back instead. 
 	 */
-	unsigned int addr;
-
-	/* Free stack  */
-	for (addr = proc->stack_start; addr < proc->stack_end;
-	     addr += PAGE_SIZE)
-		unmap_and_free_page(proc->pdir, addr);
-
-	for ((addr = proc->data_start); (addr < proc->data_end);
-	     (addr += PAGE_SIZE)) {
-		unmap_and_free_page(proc->pdir, addr);
-	}
-
-	for (addr = proc->text_start; addr < proc->text_end; addr += PAGE_SIZE)
-		unmap_and_free_page(proc->pdir, addr);
-
-	free_page_dir(proc->pdir);
-
-	if (NULL != proc->mailbox)
-		kfree(proc->mailbox);
+	if (NULL != proc->vfork_parent)
+		vfork_release(proc);
+	else
+		free_process_memory(proc);
 
 	/*
 	 * If any of this process's children are still running, change
@@ -292,8 +463,37 @@ void kill_process(process * proc)
 		}
 	}
 	proc->exited = 1;
-	if (!current)
-		enable_paging(current_process->pdir);
+}
+
+/*
+ * vfork_release
+ * 
+ * Give a process's address space back to the parent it was borrowed from by
+ * vfork. This happens when the child calls execve or exits. The child may have
+ * changed the areas making up the address space, e.g. by calling brk or mmap,
+ * so the parent takes on the child's list of them. The parent has been suspended
+ * in the vfork system call since the child was created; that call now completes,
+ * returning the child's process id. The child is left without a page directory
+ * or any areas.
+ */
+void vfork_release(process * child)
+{
+	process *parent = child->vfork_parent;
+	assert(parent->vfork_child == child);
+	assert(parent->pdir == child->pdir);
+
+	parent->vmas = child->vmas;
+
+	parent->vfork_child = NULL;
+	child->vfork_parent = NULL;
+	child->pdir = NULL;
+	child->vmas.first = NULL;
+	child->vmas.last = NULL;
+
+	parent->saved_regs.eax = child->pid;
+	parent->last_errno = 0;
+	parent->in_syscall = 0;
+	resume_process(parent);
 }
 
 /*
@@ -313,8 +513,8 @@ void suspend_process(process * proc)
 {
 	assert(proc->exists);
 	assert(proc->ready);
+	dequeue(proc);
 	proc->ready = 0;
-	list_remove(&ready, proc);
 	list_add(&suspended, proc);
 }
 
@@ -333,18 +533,19 @@ void resume_process(process * proc)
 {
 	assert(proc->exists);
 	assert(!proc->ready);
-	proc->ready = 1;
 	list_remove(&suspended, proc);
-	list_add(&ready, proc);
+	ready_process(proc);
 }
 
 /*
  * context_switch
  * 
  * Switch to another process. This is called by the timer interrupt
- * handler, which is fired 50 times per second. The current process is
- * suspended, another one is chosen from the ready list, and then this
- * is activated.
+ * handler, which is fired 50 times per second, and whenever the current
+ * process is suspended or killed. The first process in the highest
+ * priority non-empty active run queue is chosen, and then activated. This
+ * may well be the current process again, if it still has some of its time
+ * slice left and nothing of higher priority has become ready.
  * 
  * There are a few special situations we need to handle here. We need to
  * check upon entry if there is actually a process running - if not,
@@ -369,24 +570,17 @@ void context_switch(regs * r)
 		memmove(&current_process->saved_regs, r, sizeof(regs));
 
 	/*
-	 * If the current process is no longer in the ready list
-	 * (i.e. it has just been suspended), then we can't use the next
-	 * pointer, since this will point to the next process in the
-	 * suspended list instead of the ready list.  Instead, act as if
-	 * there is no current process.
-	 */
-	if (!current_process->ready)
-		current_process = NULL;
-
-	/*
-	 * Round-robin scheduling: Move to the next process in the ready
-	 * list, or to the first item in the list if the current process
-	 * was the last (or null)
+	 * If every process in the active run queues has used up its time
+	 * slice, start a new round with the expired ones
 	 */
-	if (current_process && current_process->next)
-		current_process = current_process->next;
-	else
-		current_process = ready.first;
+	int prio = highest_priority(active);
+	if (0 > prio) {
+		runqueue *rq = active;
+		active = expired;
+		expired = rq;
+		prio = highest_priority(active);
+	}
+	current_process = (0 > prio) ? NULL : active->queue[prio].first;
 
 	if (current_process) {
 		/*
@@ -407,5 +601,14 @@ void context_switch(regs * r)
 		 */
 		char *end = idle_stack + IDLE_STACK_SIZE;
 		init_regs(r, (unsigned int)end, idle);
+
+		/*
+		 * Make use of the time we would otherwise spend spinning in
+		 * the idle loop to zero some pages in advance. The idle loop
+		 * runs with only the kernel's mappings, which interrupt
+		 * handlers need in order to reach vmalloc'd buffers. 
+		 */
+		refill_zero_pool();
+		enable_paging(kernel_pdir);
 	}
 }
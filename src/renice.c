@@ -0,0 +1,27 @@
+/*
+ *      renice.c
+ *      
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <user.h>
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 3) {
+		printf("Usage: renice [priority] [pid] ...\n");
+		printf("priority ranges from %d (highest) to %d (lowest)\n",
+		       NICE_MIN, NICE_MAX);
+		exit(1);
+	}
+
+	for (i = 2; i < argc; i++) {
+		if (-1 == setpriority(atoi(argv[i]), atoi(argv[1]))) {
+			perror("renice");
+			exit(1);
+		}
+	}
+	exit(0);
+}
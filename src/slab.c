@@ -0,0 +1,168 @@
+/*
+ *      slab.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+/*
+ * Object caches
+ *
+ * Small kernel objects which are created and destroyed very frequently, such as
+ * file handles and pipe buffers, are poorly served by going straight to the buddy
+ * allocator. Every request is rounded up to at least 256 bytes, and each
+ * allocation or release has to split or coalesce blocks. The functions in this
+ * file implement a slab allocator on top of kmalloc, which carves larger buddy
+ * blocks (slabs) up into many objects of a single type.
+ *
+ * Each cache keeps three lists of slabs: those with every object allocated
+ * (full), those with some free objects (partial), and those with none allocated
+ * (empty). Allocation takes an object from the first partial slab, and freeing
+ * returns it to the slab that contains it. Both operations are O(1).
+ *
+ * Slabs are allocated with kmalloc, and the buddy allocator always returns blocks
+ * aligned to their size. We rely on this to find the slab header for an object
+ * just by masking off the low bits of its address.
+ */
+
+/*
+ * Each slab should hold at least this many objects; larger objects get
+ * correspondingly larger slabs
+ */
+#define SLAB_MIN_OBJECTS 4
+
+/*
+ * Number of completely empty slabs a cache may hold on to before they start
+ * being returned to the buddy allocator
+ */
+#define SLAB_MAX_EMPTY   1
+
+/*
+ * The free list link for each object is stored in a word immediately after the
+ * object itself, rather than inside it, so that state set up by the cache's
+ * constructor is preserved while the object is sitting in the cache.
+ */
+#define obj_link(_c,_o)  (*(void **)((char *)(_o) + (_c)->objsize))
+
+/*
+ * slab_setup
+ *
+ * Work out the geometry of the slabs used by a cache. This is done lazily when the
+ * first slab is created, so that caches can be defined statically with the
+ * KMEM_CACHE initialiser.
+ */
+static void slab_setup(kmem_cache * cache)
+{
+	cache->objsize = (cache->objsize + 3) & ~3;
+	cache->slabsize = PAGE_SIZE;
+	while ((cache->slabsize - sizeof(slab)) /
+	       (cache->objsize + sizeof(void *)) < SLAB_MIN_OBJECTS)
+		cache->slabsize *= 2;
+	cache->perslab = (cache->slabsize - sizeof(slab)) /
+	    (cache->objsize + sizeof(void *));
+}
+
+/*
+ * slab_grow
+ *
+ * Obtain a new slab for a cache from the buddy allocator, and thread all of its
+ * objects onto the slab's free list. The constructor is run once for each object
+ * here; objects are expected to be returned to the cache in their constructed
+ * state, so it does not need to be run again on subsequent allocations.
+ */
+static slab *slab_grow(kmem_cache * cache)
+{
+	if (0 == cache->slabsize)
+		slab_setup(cache);
+
+	slab *s = (slab *) kmalloc(cache->slabsize);
+	assert(0 == (unsigned int)s % cache->slabsize);
+	s->prev = NULL;
+	s->next = NULL;
+	s->cache = cache;
+	s->inuse = 0;
+	s->free = NULL;
+
+	char *obj = (char *)(s + 1);
+	unsigned int i;
+	for (i = 0; i < cache->perslab; i++) {
+		if (NULL != cache->ctor)
+			cache->ctor(obj);
+		obj_link(cache, obj) = s->free;
+		s->free = obj;
+		obj += cache->objsize + sizeof(void *);
+	}
+
+	list_add(&cache->empty, s);
+	cache->nempty++;
+	return s;
+}
+
+/*
+ * kmem_cache_alloc
+ *
+ * Allocate an object from a cache. Partially used slabs are preferred over empty
+ * ones, to keep the number of slabs in use as small as possible. A new slab is
+ * only obtained from the buddy allocator if there are no free objects left in any
+ * of the cache's existing slabs.
+ */
+void *kmem_cache_alloc(kmem_cache * cache)
+{
+	slab *s = cache->partial.first;
+	if (NULL == s) {
+		s = cache->empty.first;
+		if (NULL == s)
+			s = slab_grow(cache);
+		list_remove(&cache->empty, s);
+		cache->nempty--;
+		list_add(&cache->partial, s);
+	}
+
+	void *obj = s->free;
+	assert(NULL != obj);
+	s->free = obj_link(cache, obj);
+	s->inuse++;
+
+	if (cache->perslab == s->inuse) {
+		list_remove(&cache->partial, s);
+		list_add(&cache->full, s);
+	}
+	return obj;
+}
+
+/*
+ * kmem_cache_free
+ *
+ * Return an object to the cache it was allocated from. If this leaves the slab
+ * with no objects in use, it is moved to the empty list, and released back to the
+ * buddy allocator if the cache already has enough empty slabs in reserve.
+ */
+void kmem_cache_free(kmem_cache * cache, void *obj)
+{
+	if (NULL == obj)
+		return;
+
+	slab *s = (slab *) ((unsigned int)obj & ~(cache->slabsize - 1));
+	assert(s->cache == cache);
+	assert(0 < s->inuse);
+
+	if (cache->perslab == s->inuse) {
+		list_remove(&cache->full, s);
+		list_add(&cache->partial, s);
+	}
+
+	obj_link(cache, obj) = s->free;
+	s->free = obj;
+	s->inuse--;
+
+	if (0 == s->inuse) {
+		list_remove(&cache->partial, s);
+		if (SLAB_MAX_EMPTY <= cache->nempty) {
+			kfree(s);
+		} else {
+			list_add(&cache->empty, s);
+			cache->nempty++;
+		}
+	}
+}
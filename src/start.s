@@ -16,13 +16,50 @@
 .globl fpustate
 .globl enter_user_mode
 .globl enable_paging
-.globl disable_paging
+.globl enable_global_pages
+.globl invalidate_page
 .globl getcr2
 
 .globl ih_stack
 
+# The kernel is linked to run at KERNEL_VIRT_BASE plus its physical address, but
+# the boot loader jumps here with paging disabled. Before anything else, build a
+# page directory mapping the first BOOT_MAP_SIZE bytes of memory both at their
+# physical addresses, so that the next few instructions keep working, and at
+# KERNEL_VIRT_BASE, then enable paging and jump to the higher half. page_init
+# later replaces this with kernel_pdir, which no longer maps the low addresses.
+# Until then, symbols must be converted to physical addresses by hand.
 start:
+  mov $(boot_ptables - KERNEL_VIRT_BASE),%edi
+  mov $0x3,%eax # PAGE_PRESENT | PAGE_READ_WRITE
+  mov $(BOOT_MAP_SIZE / 4096),%ecx
+1:
+  mov %eax,(%edi)
+  add $4096,%eax
+  add $4,%edi
+  loop 1b
+
+  mov $(boot_pdir - KERNEL_VIRT_BASE),%edi
+  mov $(boot_ptables - KERNEL_VIRT_BASE + 0x3),%eax
+  mov $(BOOT_MAP_SIZE / (4*MB)),%ecx
+2:
+  mov %eax,(%edi)
+  mov %eax,(KERNEL_VIRT_BASE / (4*MB) * 4)(%edi)
+  add $4096,%eax
+  add $4,%edi
+  loop 2b
+
+  mov $(boot_pdir - KERNEL_VIRT_BASE),%eax
+  mov %eax,%cr3
+  mov %cr0,%eax
+  or $0x80000000,%eax
+  mov %eax,%cr0
+  mov $higher_half,%eax
+  jmp *%eax
+
+higher_half:
   mov $sys_stack,%esp
+  add $KERNEL_VIRT_BASE,%ebx
   push %ebx # multiboot header
   call kmain
 
@@ -39,11 +76,12 @@ mboot:
   .int MULTIBOOT_HEADER_FLAGS
   .int MULTIBOOT_CHECKSUM
 
-  .int mboot 	# Location of this descriptor
-  .int code 	# Start of kernel '.text' (code) section.
-  .int bss 	# End of kernel '.data' section.
-  .int end 	# End of kernel.
-  .int start 	# Kernel entry point (initial EIP).
+  # The boot loader needs physical addresses here
+  .int mboot - KERNEL_VIRT_BASE 	# Location of this descriptor
+  .int code - KERNEL_VIRT_BASE 	# Start of kernel '.text' (code) section.
+  .int bss - KERNEL_VIRT_BASE 	# End of kernel '.data' section.
+  .int end - KERNEL_VIRT_BASE 	# End of kernel.
+  .int start - KERNEL_VIRT_BASE 	# Kernel entry point (initial EIP).
 
 idle:
   jmp idle
@@ -227,22 +265,69 @@ switch_to_user_end:        # The iret instruction will "return" here
   ret
 
 enable_paging:
-  # Get the parameter to this function from the stack, and store it in the CR3
-  # register, which tells the processor which page directory to use
+  # Get the parameter to this function from the stack. If paging is already
+  # enabled with this page directory, there is nothing to do, and reloading CR3
+  # would needlessly flush the TLB
   movl 4(%esp),%eax
+  movl %cr0,%ecx
+  testl $0x80000000,%ecx
+  jz 1f
+  movl %cr3,%edx
+  cmpl %eax,%edx
+  je 2f
+1:
+  # Store the page directory in the CR3 register, which tells the processor
+  # which page directory to use. This flushes all TLB entries except for global
+  # ones.
   movl %eax,%cr3
   # Set the paging bit of the CR0 register, which tells the processor to enable
-  # paging
-  movl %cr0,%eax
-  orl $0x80000000,%eax
-  movl %eax,%cr0
+  # paging, and the write protect bit, which makes read-only pages read-only
+  # for the kernel too, so that copy-on-write works for system calls
+  orl $0x80010000,%ecx
+  movl %ecx,%cr0
+2:
   ret
 
-disable_paging:
-  # Clear the paging bit of the CR0 register
-  movl %cr0,%eax
-  andl $0x7FFFFFFF,%eax
-  movl %eax,%cr0
+# Removes the TLB entry (if any) for the page containing the address given as
+# the parameter, so that a change to its page table entry takes effect. This
+# works for global pages as well.
+invalidate_page:
+  movl 4(%esp),%eax
+  invlpg (%eax)
+  ret
+
+# Enables global pages, if the processor supports them, by setting the PGE bit
+# of the CR4 register. Returns 1 if global pages are enabled, or 0 otherwise.
+# TLB entries for pages marked global are not flushed when CR3 is reloaded.
+enable_global_pages:
+  # Check that the processor supports the CPUID instruction, by seeing whether
+  # the ID bit of EFLAGS can be changed
+  pushfl
+  popl %eax
+  movl %eax,%ecx
+  xorl $0x200000,%eax
+  pushl %eax
+  popfl
+  pushfl
+  popl %eax
+  pushl %ecx
+  popfl
+  xorl %ecx,%eax
+  jz 1f
+  # Check the PGE feature flag (CPUID function 1, bit 13 of EDX)
+  pushl %ebx
+  movl $1,%eax
+  cpuid
+  popl %ebx
+  testl $0x2000,%edx
+  jz 1f
+  movl %cr4,%eax
+  orl $0x80,%eax
+  movl %eax,%cr4
+  movl $1,%eax
+  ret
+1:
+  movl $0,%eax
   ret
 
 # Returns the value of the CR2 register, which in the case of a page fault,
@@ -270,7 +355,44 @@ outb:
   pop %edx
   ret
 
+# Reads count 16-bit words from an I/O port into a buffer
+.globl insw
+insw:
+  push %edi
+  push %edx
+  push %ecx
+  movl 16(%esp),%edx
+  movl 20(%esp),%edi
+  movl 24(%esp),%ecx
+  cld
+  rep insw
+  pop %ecx
+  pop %edx
+  pop %edi
+  ret
+
+# Writes count 16-bit words from a buffer to an I/O port
+.globl outsw
+outsw:
+  push %esi
+  push %edx
+  push %ecx
+  movl 16(%esp),%edx
+  movl 20(%esp),%esi
+  movl 24(%esp),%ecx
+  cld
+  rep outsw
+  pop %ecx
+  pop %edx
+  pop %esi
+  ret
+
 .section .bss
+  .align 4096
+boot_pdir:
+  .skip 4096
+boot_ptables:
+  .skip BOOT_MAP_SIZE / 1024
   .lcomm fpustate,108
   .lcomm sys_stack_top,65536
   .lcomm sys_stack,0
@@ -0,0 +1,149 @@
+/*
+ *      swap.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+/*
+ * Swap space
+ *
+ * When physical memory runs out, the frame allocator can evict pages of process
+ * memory to disk to make room (see swap_out_page in page.c). Swapping is
+ * optional. It is only enabled if there is an ATA disk (see ata.c) and the disk
+ * starts with SWAP_SIGNATURE, so that a disk holding anything else is never
+ * overwritten. The swap.img target of the Makefile creates such an image, and
+ * run-qemu attaches it with -hda.
+ *
+ * The disk is divided into slots of one page each. Slot 0 holds the signature,
+ * so it is never handed out, and a slot number of 0 means "no slot". The page
+ * table entry of an evicted page is not present and has PAGE_SWAPPED set, with
+ * the slot number where the frame address would normally be. Each slot has a
+ * reference count, like a frame, since fork copies swapped entries into the
+ * child without reading them in. Whichever process faults a page in first gets
+ * a private copy of it, and the slot is released once no entries refer to it.
+ */
+
+#define SWAP_SIGNATURE      "RHYTHMOS-SWAP"
+#define SECTORS_PER_SLOT    (PAGE_SIZE / ATA_SECTOR_SIZE)
+#define SWAP_MAX_SLOTS      (1 << 20)	/* slot numbers must fit in a pte */
+
+static unsigned char *slot_refs = NULL;
+static unsigned int slot_count = 0;
+static unsigned int slot_hint = 1;	/* all slots before this are in use */
+
+unsigned int swap_slots_free = 0;
+
+/*
+ * swap_init
+ *
+ * Look for a swap disk, and set up the reference counts for its slots if there
+ * is one. This must be called after vmalloc_init, since a large disk needs more
+ * than KMALLOC_MAX bytes of counts.
+ */
+void swap_init(void)
+{
+	char header[ATA_SECTOR_SIZE];
+	unsigned int sectors = ata_init();
+	if (sectors < 2 * SECTORS_PER_SLOT)
+		return;
+
+	if ((0 != ata_read(0, 1, header)) ||
+	    (0 != strncmp(header, SWAP_SIGNATURE, strlen(SWAP_SIGNATURE)))) {
+		kprintf("Swap: disk has no swap signature, not using it\n");
+		return;
+	}
+
+	slot_count = sectors / SECTORS_PER_SLOT;
+	if (slot_count > SWAP_MAX_SLOTS)
+		slot_count = SWAP_MAX_SLOTS;
+	slot_refs = (unsigned char *)kmalloc(slot_count);
+	memset(slot_refs, 0, slot_count);
+	slot_refs[0] = 1;
+	swap_slots_free = slot_count - 1;
+
+	kprintf("Swap: %uKb\n", swap_slots_free * (PAGE_SIZE / KB));
+}
+
+/*
+ * swap_alloc
+ *
+ * Find a free slot, and give it a reference count of 1. Returns 0 if the swap
+ * space is full, or there is none.
+ */
+unsigned int swap_alloc(void)
+{
+	unsigned int slot;
+	if (0 == swap_slots_free)
+		return 0;
+	for (slot = slot_hint; slot < slot_count; slot++) {
+		if (0 == slot_refs[slot]) {
+			slot_refs[slot] = 1;
+			swap_slots_free--;
+			slot_hint = slot + 1;
+			return slot;
+		}
+	}
+	return 0;
+}
+
+/*
+ * swap_dup
+ *
+ * Record an additional reference to a slot, which is about to be copied into
+ * another page table
+ */
+void swap_dup(unsigned int slot)
+{
+	assert((0 < slot) && (slot < slot_count));
+	assert(0 < slot_refs[slot]);
+	assert(255 > slot_refs[slot]);
+	slot_refs[slot]++;
+}
+
+/*
+ * swap_free
+ *
+ * Drop a reference to a slot, making it available again once there are none left
+ */
+void swap_free(unsigned int slot)
+{
+	assert((0 < slot) && (slot < slot_count));
+	assert(0 < slot_refs[slot]);
+	if (0 < --slot_refs[slot])
+		return;
+	swap_slots_free++;
+	if (slot < slot_hint)
+		slot_hint = slot;
+}
+
+/*
+ * swap_write
+ *
+ * Copy the contents of a frame to a slot. Returns 0 on success, or -EIO if the
+ * disk reported an error.
+ */
+int swap_write(unsigned int slot, unsigned int page)
+{
+	assert((0 < slot) && (slot < slot_count));
+	if (0 != ata_write(slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT,
+			   phys_to_virt(page)))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * swap_read
+ *
+ * Copy the contents of a slot to a frame. Returns 0 on success, or -EIO if the
+ * disk reported an error.
+ */
+int swap_read(unsigned int slot, unsigned int page)
+{
+	assert((0 < slot) && (slot < slot_count));
+	if (0 != ata_read(slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT,
+			  phys_to_virt(page)))
+		return -EIO;
+	return 0;
+}
@@ -17,6 +17,12 @@ int syscall_close(int fd);
 int syscall_pipe(int filedes[2]);
 int syscall_dup2(int oldfd, int newfd);
 
+/*
+ * process.c 
+ */
+int syscall_nice(int inc);
+int syscall_setpriority(pid_t pid, int nice);
+
 /*
  * unixproc.c 
  */
@@ -35,9 +41,28 @@ int syscall_getdent(int fd, struct dirent *entry);
 int syscall_chdir(const char *path);
 char *syscall_getcwd(char *buf, size_t size);
 
+/*
+ * mmap.c 
+ */
+void *syscall_mmap(void *addr, size_t len, int prot, int flags, int fd,
+		   unsigned int offset);
+int syscall_munmap(void *addr, size_t len);
+int syscall_setpager(void *addr, size_t len, pid_t pager);
+int syscall_mappage(pid_t pid, void *addr, const void *data);
+
 extern process *current_process;
 process processes[MAX_PROCESSES];
 
+/*
+ * Mailboxes start out with room for MAILBOX_SIZE messages, and are kept in their
+ * own object cache. A mailbox is just over 8Kb, so kmalloc would round each one
+ * up to a 16Kb block, whereas a 64Kb slab holds seven of them. A mailbox that
+ * fills up is moved to kmalloc'd memory and grown from there with krealloc, up
+ * to MAILBOX_MAX messages.
+ */
+kmem_cache mailbox_cache =
+    KMEM_CACHE("mailbox", MAILBOX_SIZE * sizeof(message), NULL);
+
 /**
  * valid_pointer
  * 
@@ -47,8 +72,12 @@ process processes[MAX_PROCESSES];
  * by tricking the kernel into reading from or writing to an area of memory that
  * the process would not normally have access to.
  * 
+ * Any pages of the buffer that are not in memory are brought in straight away
+ * (see vma_fault_in), since the kernel cannot recover from a page fault that
+ * fails part way through a system call. Returns 0 if the buffer can be used,
+ * -EFAULT if it is invalid, or -ENOMEM or -EIO if it could not be brought in.
  * Any system call which has an invalid pointer supplied to it is supposed to
- * return -EFAULT.
+ * return this error.
  */
 int valid_pointer(const void *ptr, unsigned int size)
 {
@@ -56,36 +85,43 @@ int valid_pointer(const void *ptr, unsigned int size)
 	unsigned int end_address = start_address + size;
 
 	if (0 == size)
-		return 1;
+		return 0;
 
 	if (end_address < start_address)
-		return 0;
+		return -EFAULT;
 
 	/*
-	 * Within stack segment? 
+	 * Every page in the range must belong to an area of the process's address
+	 * space that it is allowed to read 
 	 */
-	if ((start_address >= current_process->stack_start) &&
-	    (end_address <= current_process->stack_end))
-		return 1;
+	if (!vma_access_ok(start_address, end_address, PROT_READ))
+		return -EFAULT;
 
-	/*
-	 * Within data segment? 
-	 */
-	if ((start_address >= current_process->data_start) &&
-	    (end_address <= current_process->data_end))
-		return 1;
+	return vma_fault_in(start_address, end_address, 0);
+}
 
-	/*
-	 * Within text segment? 
-	 */
-	if ((start_address >= current_process->text_start) &&
-	    (end_address <= current_process->text_end))
-		return 1;
+/**
+ * valid_write_pointer
+ * 
+ * Like valid_pointer, but for buffers the kernel is going to write to on behalf
+ * of the process, which must also be writable by it. Otherwise a read into a
+ * read-only mapping would fault in kernel mode.
+ */
+int valid_write_pointer(void *ptr, unsigned int size)
+{
+	unsigned int start_address = (unsigned int)ptr;
+	unsigned int end_address = start_address + size;
 
-	/*
-	 * Pointer is invalid 
-	 */
-	return 0;
+	if (0 == size)
+		return 0;
+
+	if (end_address < start_address)
+		return -EFAULT;
+
+	if (!vma_access_ok(start_address, end_address, PROT_READ | PROT_WRITE))
+		return -EFAULT;
+
+	return vma_fault_in(start_address, end_address, 1);
 }
 
 /**
@@ -93,18 +129,23 @@ int valid_pointer(const void *ptr, unsigned int size)
  * 
  * Similar to valid_pointer. In the case of strings, we can simply check for a
  * particular length, since they are just arrays of characters terminated by '\0'.
- * So instead we have to scan through the string, checking that each part is valid
- * until we encounter the NULL terminator.
+ * So instead we have to scan through the string, checking each page that it
+ * reaches until we encounter the NULL terminator. Returns 0 or an error code, as
+ * for valid_pointer.
  */
 int valid_string(const char *str)
 {
 	unsigned int len = 0;
-	while (valid_pointer(str, len + 1)) {
+	while (1) {
+		if ((0 == len) || (0 == (unsigned int)(str + len) % PAGE_SIZE)) {
+			int r = valid_pointer(str + len, 1);
+			if (0 != r)
+				return r;
+		}
 		if ('\0' == str[len])
-			return 1;
+			return 0;
 		len++;
 	}
-	return 0;
 }
 
 /**
@@ -126,7 +167,6 @@ static pid_t syscall_getpid()
  */
 static int syscall_exit(int status)
 {
-	disable_paging();
 	current_process->exit_status = status;
 	kill_process(current_process);
 	return -ESUSPEND;
@@ -143,8 +183,9 @@ static int syscall_exit(int status)
  */
 static ssize_t syscall_write(int fd, const void *buf, size_t count)
 {
-	if (!valid_pointer(buf, count))
-		return -EFAULT;
+	int r = valid_pointer(buf, count);
+	if (0 != r)
+		return r;
 	if ((0 > fd) || (MAX_FDS <= fd)
 	    || (NULL == current_process->filedesc[fd]))
 		return -EBADF;
@@ -162,8 +203,9 @@ static ssize_t syscall_write(int fd, const void *buf, size_t count)
  */
 static ssize_t syscall_read(int fd, void *buf, size_t count)
 {
-	if (!valid_pointer(buf, count))
-		return -EFAULT;
+	int r = valid_write_pointer(buf, count);
+	if (0 != r)
+		return r;
 	if ((0 > fd) || (MAX_FDS <= fd)
 	    || (NULL == current_process->filedesc[fd]))
 		return -EBADF;
@@ -192,15 +234,20 @@ static pid_t syscall_geterrno(void)
  * syscall_brk
  * 
  * Called by a process when it wishes to extend the size of its data segment. The
- * memory allocation scheme used by processes in our kernel is based on a fixed
- * heap size, and thus each process calls brk only once, right at the beginning of
- * its execution. More advanced memory allocation schemes would allow the heap to
- * be extended if more memory is needed, and would call this function whenever they
- * need more pages mapped into their data segment for use by malloc.
+ * user-space malloc starts out with a small heap, set up by a call to brk at the
+ * beginning of the process's execution, and calls brk again to extend the data
+ * segment whenever it needs to grow the heap.
+ * 
+ * No memory is allocated here. The new part of the data segment is demand-zero:
+ * each page is only mapped when the process first touches it, at which point the
+ * page fault handler calls map_demand_zero. The data segment may not grow into
+ * another area, or into the space reserved for the stack; -ENOMEM is returned
+ * if it would.
  */
 static int syscall_brk(void *end_data_segment)
 {
-	unsigned int oldend = current_process->data_end;
+	vm_area *data = vma_segment(current_process, VMA_DATA);
+	unsigned int oldend = data->end;
 	unsigned int newend = (unsigned int)end_data_segment;
 
 	/*
@@ -215,11 +262,11 @@ static int syscall_brk(void *end_data_segment)
 	if (0 != newend % PAGE_SIZE)
 		newend = ((newend / PAGE_SIZE) + 1) * PAGE_SIZE;
 
-	disable_paging();
-	map_new_pages(current_process->pdir, oldend,
-		      (newend - oldend) / PAGE_SIZE);
-	enable_paging(current_process->pdir);
-	current_process->data_end = newend;
+	if ((newend > PROCESS_STACK_BASE - PROCESS_STACK_MAX) ||
+	    !vma_range_free(current_process, oldend, newend))
+		return -ENOMEM;
+
+	data->end = newend;
 	return 0;
 }
 
@@ -245,41 +292,45 @@ static inline void __attribute__ ((noreturn))
 }
 
 /**
- * syscall_send - Sends a message to the specified process.
- * @tag: is an application-defined value indicating the type of the message
- * @data: contents of the message
- * @size: size of the message.
+ * deliver_message
  * 
- * The maximum size is 1024 bytes. 
- * send returns 0 on success, or -1 on error (setting errno appropriately). 
- * It should never block. 
+ * Add a message to the end of a process's mailbox, and wake the process up if it
+ * is blocked in receive. This is used by send, and by the kernel itself to pass
+ * messages to processes, e.g. page faults to a pager (see mmap.c). The data is
+ * copied from the current address space, and must be no more than
+ * MAX_MESSAGE_SIZE bytes. Returns 0 on success, or -ENOMEM if the mailbox is full.
  */
-int syscall_send(pid_t to, unsigned int tag, const void *data, size_t size)
+int
+deliver_message(process * dest, pid_t from, unsigned int tag,
+		const void *data, size_t size)
 {
-	if (!valid_pointer(data, size))
-		return -EFAULT;
-
-	if ((0 > to) || (MAX_PROCESSES <= to) || !processes[to].exists)
-		return -ESRCH;
-
-	if ((0 > size) || (MAX_MESSAGE_SIZE < size))
-		return -EINVAL;
-
-	process *dest = &processes[to];
-
+	assert(MAX_MESSAGE_SIZE >= size);
 	if (NULL == dest->mailbox) {
-		dest->mailbox_alloc = 8;
+		dest->mailbox_alloc = MAILBOX_SIZE;
 		dest->mailbox_size = 1;
-		dest->mailbox =
-		    (message *) kmalloc(dest->mailbox_alloc * sizeof(message));
+		dest->mailbox = (message *) kmem_cache_alloc(&mailbox_cache);
 	} else if (dest->mailbox_size < dest->mailbox_alloc) {
 		dest->mailbox_size++;
-	} else {
+	} else if (dest->mailbox_alloc >= MAILBOX_MAX) {
 		return -ENOMEM;
+	} else if (MAILBOX_SIZE == dest->mailbox_alloc) {
+		message *newbox =
+		    (message *) kmalloc(2 * MAILBOX_SIZE * sizeof(message));
+		memcpy(newbox, dest->mailbox, MAILBOX_SIZE * sizeof(message));
+		kmem_cache_free(&mailbox_cache, dest->mailbox);
+		dest->mailbox = newbox;
+		dest->mailbox_alloc = 2 * MAILBOX_SIZE;
+		dest->mailbox_size++;
+	} else {
+		dest->mailbox_alloc *= 2;
+		dest->mailbox = (message *) krealloc(dest->mailbox,
+						     dest->mailbox_alloc *
+						     sizeof(message));
+		dest->mailbox_size++;
 	}
 
 	message *msg = &dest->mailbox[dest->mailbox_size - 1];
-	msg->from = current_process->pid;
+	msg->from = from;
 	msg->tag = tag;
 	msg->size = size;
 	memcpy(msg->data, data, size);
@@ -292,6 +343,32 @@ int syscall_send(pid_t to, unsigned int tag, const void *data, size_t size)
 	return 0;
 }
 
+/**
+ * syscall_send - Sends a message to the specified process.
+ * @tag: is an application-defined value indicating the type of the message
+ * @data: contents of the message
+ * @size: size of the message.
+ * 
+ * The maximum size is 1024 bytes. 
+ * send returns 0 on success, or -1 on error (setting errno appropriately). 
+ * It should never block. 
+ */
+int syscall_send(pid_t to, unsigned int tag, const void *data, size_t size)
+{
+	int r = valid_pointer(data, size);
+	if (0 != r)
+		return r;
+
+	if ((0 > to) || (MAX_PROCESSES <= to) || !processes[to].exists)
+		return -ESRCH;
+
+	if ((0 > size) || (MAX_MESSAGE_SIZE < size))
+		return -EINVAL;
+
+	return deliver_message(&processes[to], current_process->pid, tag, data,
+			       size);
+}
+
 /**
  * syscall_receive - Receives a message sent to the current process.
  * @message: If a message is available immediately the sender, tag, size, and 
@@ -303,8 +380,9 @@ int syscall_send(pid_t to, unsigned int tag, const void *data, size_t size)
  */
 int syscall_receive(message * msg, int block)
 {
-	if (!valid_pointer(msg, sizeof(message)))
-		return -EFAULT;
+	int r = valid_write_pointer(msg, sizeof(message));
+	if (0 != r)
+		return r;
 
 	if (current_process->mailbox_size > 0) {
 		memcpy(msg, &current_process->mailbox[0], sizeof(message));
@@ -322,6 +400,37 @@ int syscall_receive(message * msg, int block)
 	}
 }
 
+/*
+ * Largest number of arguments taken by any system call (mmap)
+ */
+#define SYSCALL_MAX_ARGS 6
+
+/**
+ * get_syscall_args
+ * 
+ * Copy the arguments of a system call from the process's stack, where they
+ * start at uargs. Each word is checked with valid_pointer first, so that it is
+ * brought back into memory if it has been swapped out, rather than faulting in
+ * kernel mode. A call near the top of the stack may have fewer than
+ * SYSCALL_MAX_ARGS words above it; the remaining arguments are left as 0, and
+ * any call that actually needs them will find them invalid. Returns 0 on
+ * success, or -ENOMEM or -EIO if an argument could not be brought in.
+ */
+static int get_syscall_args(const int *uargs, int *args)
+{
+	unsigned int i;
+	memset(args, 0, SYSCALL_MAX_ARGS * sizeof(int));
+	for (i = 0; i < SYSCALL_MAX_ARGS; i++) {
+		int r = valid_pointer(&uargs[i], sizeof(int));
+		if (-EFAULT == r)
+			break;
+		if (0 != r)
+			return r;
+		args[i] = uargs[i];
+	}
+	return 0;
+}
+
 /**
  * syscall
  * 
@@ -345,10 +454,12 @@ void syscall(regs * r)
 	 * to this call are 4 bytes below this in the stack (right underneath the
 	 * return address). In our kernel, all parameters to system calls are 32 bits
 	 * wide, so we can just treat this address as the start of an array of
-	 * integers. Where necessary these may be cast to pointers. 
+	 * integers. Where necessary these may be cast to pointers. They are
+	 * copied into the kernel before the call starts, since they may have to
+	 * be swapped in, and that can fail.
 	 */
 	unsigned int useresp = r->useresp;
-	int *args = (int *)(useresp + 4);
+	int args[SYSCALL_MAX_ARGS];
 
 	int res = -1;
 	process *old_current = current_process;
@@ -356,6 +467,10 @@ void syscall(regs * r)
 	assert(current_process);
 	current_process->in_syscall = call_no;
 
+	res = get_syscall_args((const int *)(useresp + 4), args);
+	if (0 != res)
+		goto DONE;
+
 	/*
 	 * Dispatch to the appropriate handler function 
 	 */
@@ -427,6 +542,26 @@ void syscall(regs * r)
 	case SYSCALL_HALT:
 		syscall_halt();
 		break;
+	case SYSCALL_MMAP:
+		res = (int)syscall_mmap((void *)args[0], args[1], args[2],
+					args[3], args[4], args[5]);
+		break;
+	case SYSCALL_MUNMAP:
+		res = syscall_munmap((void *)args[0], args[1]);
+		break;
+	case SYSCALL_SETPAGER:
+		res = syscall_setpager((void *)args[0], args[1], args[2]);
+		break;
+	case SYSCALL_MAPPAGE:
+		res = syscall_mappage(args[0], (void *)args[1],
+				      (const void *)args[2]);
+		break;
+	case SYSCALL_NICE:
+		res = syscall_nice(args[0]);
+		break;
+	case SYSCALL_SETPRIORITY:
+		res = syscall_setpriority(args[0], args[1]);
+		break;
 	default:
 		kprintf("Warning: Call to unimplemented system call %d\n",
 			call_no);
@@ -434,6 +569,7 @@ void syscall(regs * r)
 		break;
 	}
 
+ DONE:
 	/*
 	 * Store the errno value, in case the process subsequently calls geterrno() 
 	 */
@@ -60,9 +60,90 @@ void print_mem_line(memarea * ma, int length)
 	printf("%s\n", line);
 }
 
+/*
+ * Fill a block with a byte value, so that its contents can be checked later
+ */
+void fill_block(memarea * ma, void *ptr, unsigned char value)
+{
+	memset(ptr, value, buddy_size(ma, ptr));
+}
+
+/*
+ * Check that the first n bytes of a block all have the value it was filled
+ * with. Comparing the block with itself shifted by one byte checks that every
+ * byte is the same as the first.
+ */
+void check_block(void *ptr, unsigned int n, unsigned char value)
+{
+	unsigned char *c = (unsigned char *)ptr;
+	assert(value == c[0]);
+	assert(0 == memcmp(c, c + 1, n - 1));
+}
+
+/*
+ * Check that a block is the size that buddy_alloc would give for nbytes: the
+ * smallest power of two no smaller than nbytes, and at least 2^DEFAULT_LOWER
+ */
+void check_size(memarea * ma, void *ptr, unsigned int nbytes)
+{
+	unsigned int size = buddy_size(ma, ptr);
+	unsigned int min = 1 << DEFAULT_LOWER;
+	assert(0 == (size & (size - 1)));
+	assert(size >= nbytes);
+	assert((size / 2 < nbytes) || (size == min));
+}
+
+/*
+ * Enlarge a memarea with buddy_grow, first while it is entirely free, so that
+ * the existing region is merged into the new top-level block, and then while
+ * part of it is allocated, so that the new half is added as a free block of its
+ * own
+ */
+void test_grow(void)
+{
+	memarea ma;
+	blockinfo *blocks = malloc(buddy_nblocks(22) * sizeof(blockinfo));
+	char *membase = malloc(1 << 22);
+	memset(membase, 0, 1 << 22);
+
+	buddy_init(&ma, 20, membase, blocks);	/* 1 Mb */
+
+	buddy_grow(&ma, 21);
+	assert(21 == ma.upper);
+	void *whole = buddy_alloc(&ma, 1 << 21);
+	assert(membase == whole);
+	buddy_free(&ma, whole);
+
+	void *small = buddy_alloc(&ma, 1000);
+	assert(NULL != small);
+	fill_block(&ma, small, 0xAB);
+	assert(NULL == buddy_alloc(&ma, 1 << 21));
+
+	buddy_grow(&ma, 22);
+	assert(22 == ma.upper);
+	void *upper = buddy_alloc(&ma, 1 << 21);
+	assert(membase + (1 << 21) == upper);
+	void *lower = buddy_alloc(&ma, 1 << 20);
+	assert((NULL != lower) && ((char *)lower < membase + (1 << 21)));
+	assert(NULL == buddy_alloc(&ma, 1 << 20));
+	check_block(small, buddy_size(&ma, small), 0xAB);
+
+	buddy_free(&ma, upper);
+	buddy_free(&ma, lower);
+	buddy_free(&ma, small);
+	whole = buddy_alloc(&ma, 1 << 22);
+	assert(membase == whole);
+	buddy_free(&ma, whole);
+
+	free(membase);
+	free(blocks);
+}
+
 int main()
 {
 	setbuf(stdout, NULL);
+	test_grow();
+
 	memarea ma;
 	unsigned int sizepow2 = 25;	/* 32 Mb */
 	blockinfo *blocks = malloc(buddy_nblocks(sizepow2) * sizeof(blockinfo));
@@ -75,21 +156,63 @@ int main()
 
 	int iterations = 40000;
 	void *allocated[iterations];
+	unsigned char values[iterations];
 	int got = 0;
-	int malloc_probability = 50;
+	int malloc_probability = 40;
+	int realloc_probability = 20;
+	int shrunk = 0;
+	int grown = 0;
+	int moved = 0;
 
 	int i;
 	for (i = 0; i < iterations; i++) {
-		if (((rand() % 100) < malloc_probability) || (0 == got)) {
+		int action = rand() % 100;
+		if ((action < malloc_probability) || (0 == got)) {
 			int nbytes = rand() % (2 * 1024 * 1024);
 			allocated[got] = buddy_alloc(&ma, nbytes);
-			if (NULL != allocated[got])
+			if (NULL != allocated[got]) {
+				check_size(&ma, allocated[got], nbytes);
+				values[got] = rand() % 256;
+				fill_block(&ma, allocated[got], values[got]);
 				got++;
+			}
+		} else if (action < malloc_probability + realloc_probability) {
+			/*
+			 * Resize a block, which may shrink it by splitting,
+			 * grow it in place by absorbing its free buddies, or
+			 * move it
+			 */
+			int index = rand() % got;
+			void *ptr = allocated[index];
+			unsigned int oldsize = buddy_size(&ma, ptr);
+			int nbytes = 1 + rand() % (2 * 1024 * 1024);
+			void *newptr = buddy_realloc(&ma, ptr, nbytes);
+			if (NULL == newptr) {
+				check_block(ptr, oldsize, values[index]);
+				continue;
+			}
+			check_size(&ma, newptr, nbytes);
+			unsigned int newsize = buddy_size(&ma, newptr);
+			unsigned int kept =
+			    (newsize < oldsize) ? newsize : oldsize;
+			check_block(newptr, kept, values[index]);
+			if (newptr != ptr)
+				moved++;
+			else if (newsize < oldsize)
+				shrunk++;
+			else if (newsize > oldsize)
+				grown++;
+			allocated[index] = newptr;
+			fill_block(&ma, newptr, values[index]);
 		} else {
 			int index = rand() % got;
+			void *ptr = allocated[index];
+			check_block(ptr, buddy_size(&ma, ptr), values[index]);
 			buddy_free(&ma, allocated[index]);
 			memmove(&allocated[index], &allocated[index + 1],
 				(got - index - 1) * sizeof(void *));
+			memmove(&values[index], &values[index + 1],
+				got - index - 1);
 			got--;
 		}
 		print_mem_line(&ma, 128);
@@ -102,5 +225,9 @@ int main()
 		}
 	}
 
+	printf("realloc: %d shrunk, %d grown in place, %d moved\n", shrunk,
+	       grown, moved);
+	assert((0 < shrunk) && (0 < grown) && (0 < moved));
+
 	return 0;
 }
@@ -9,48 +9,6 @@
 extern char *filesystem;
 extern process *current_process;
 extern process processes[MAX_PROCESSES];
-extern processlist ready;
-
-/*
- * map_and_copy
- * 
- * Maps a series of physical pages into a process's address space, copying the data
- * from the corresponding pages in another process.
- * 
- * This operates similarly to map_new_pages. The difference is that instead of
- * the pages being empty, their contents is copied from existing pages that are
- * already mapped by another process. In order to obtain the latter, we perform a
- * lookup on the source process's page directory to get the physical address of
- * each page, and then use that to obtain the data to store in the newly-allocated
- * physical pages of the destination process.
- * 
- * This is used by the fork system call, which needs to duplicate all aspects of
- * a process's state. It uses this function to copy the text, data, and stack
- * segments of the parent process.
- */
-static void
-map_and_copy(page_dir src_dir, page_dir dest_dir,
-	     unsigned int start, unsigned int end)
-{
-	assert(0 == start % PAGE_SIZE);
-	assert(0 == end % PAGE_SIZE);
-	unsigned int addr;
-	for (addr = start; addr < end; addr += PAGE_SIZE) {
-		/*
-		 * Map new page 
-		 */
-		unsigned int page = (unsigned int)alloc_page();
-		map_page(dest_dir, addr, page, PAGE_USER, PAGE_READ_WRITE);
-
-		/*
-		 * Copy from source 
-		 */
-		unsigned int src_phys;
-		int sl = lookup_page(src_dir, addr, &src_phys);
-		assert(sl);
-		memmove((void *)page, (void *)src_phys, PAGE_SIZE);
-	}
-}
 
 /*
  * syscall_fork
@@ -61,16 +19,18 @@ map_and_copy(page_dir src_dir, page_dir dest_dir,
  * fork call. The return value that the parent process sees will be the (non-zero)
  * process id of the child. The child will see a return value of 0. Based on this,
  * each of the two processes can go their separate ways, with the child process
- * typically taking completely different code
- * path, such as a call to exec.
+ * typically taking a completely different code path, such as a call to exec.
  * 
  * This call is an alternative to start_process. fork is the standard way to create
  * processes under UNIX, and in most cases is the *only* way for new processes to
  * be started, at least from user-space.
  * 
  * The *full* state of a process must be copied here, including all fields of the
- * process object, and all of the memory associated with the process in its various
- * segments (text, data, and stack).
+ * process object, and all of the memory associated with the process in its
+ * various segments (text, data, and stack) and anything it has mapped with mmap.
+ * The memory is not copied straight away; the two processes share the same
+ * pages copy-on-write until one of them modifies them (see copy_range and
+ * copy_on_write in page.c).
  */
 pid_t syscall_fork(regs * r)
 {
@@ -89,39 +49,32 @@ pid_t syscall_fork(regs * r)
 	child->exists = 1;
 
 	/*
-	 * Create a page directory for the new process, and set the segment ranges.
-	 * Note that we have to temporarily disable paging here, because we need to
-	 * deal with physical memory when allocating a page directory and setting up
-	 * the mappings. 
+	 * Create a page directory for the new process 
 	 */
-	disable_paging();
-	child->pdir = (page_dir) alloc_page();
-
-	child->text_start = parent->text_start;
-	child->text_end = parent->text_end;
-	child->data_start = parent->data_start;
-	child->data_end = parent->data_end;
-	child->stack_start = parent->stack_start;
-	child->stack_end = parent->stack_end;
+	child->pdir = new_page_dir();
+	if (NULL == child->pdir) {
+		child->exists = 0;
+		return -ENOMEM;
+	}
 
 	/*
-	 * Identity map memory 0-6Mb 
+	 * Give the child a copy of each of the parent's areas, and share the
+	 * pages in them. Rather than copying the pages now, they are made read-only
+	 * in both processes, and a private copy of each is only made when one of
+	 * them writes to it. The kernel's mappings are already shared with the new
+	 * page directory. 
 	 */
-	unsigned int addr;
-	for (addr = 0 * MB; addr < 6 * MB; addr += PAGE_SIZE)
-		map_page(child->pdir, addr, addr, PAGE_USER, PAGE_READ_ONLY);
+	int err = vma_copy(parent, child);
 
 	/*
-	 * Copy parent's text, data, and stack segments to child 
+	 * If we ran out of memory, release whatever we managed to allocate for
+	 * the child and give up 
 	 */
-	map_and_copy(parent->pdir, child->pdir, child->text_start,
-		     child->text_end);
-	map_and_copy(parent->pdir, child->pdir, child->data_start,
-		     child->data_end);
-	map_and_copy(parent->pdir, child->pdir, child->stack_start,
-		     child->stack_end);
-
-	enable_paging(current_process->pdir);
+	if (0 != err) {
+		free_process_memory(child);
+		child->exists = 0;
+		return err;
+	}
 
 	/*
 	 * Copy file handles. The reference count is increased on each of them, so
@@ -149,8 +102,8 @@ pid_t syscall_fork(regs * r)
 	 * Place the process on the ready list, so that it can begin execution on a
 	 * subsequent context switch 
 	 */
-	child->ready = 1;
-	list_add(&ready, child);
+	child->nice = parent->nice;
+	ready_process(child);
 
 	/*
 	 * Return the child's process id... note that this value will only go to the
@@ -162,34 +115,28 @@ pid_t syscall_fork(regs * r)
 /* 
  * syscall_vfork
  * 
- * The vfork() function differs from fork() only in that the child process can 
- * share code and data with the calling process (parent process). This speeds 
+ * The vfork() function differs from fork() only in that the child process
+ * shares code and data with the calling process (parent process). This speeds 
  * cloning activity significantly at a risk to the integrity of the parent 
  * process if vfork() is misused.
  * 
- * 
  * The use of vfork() for any purpose except as a prelude to an immediate call 
  * to a function from the exec family, or to _exit(), is not advised.
  * 
- * The vfork() function can be used to create new processes without fully 
- * copying the address space of the old process. If a forked process is simply 
- * going to call exec, the data space copied from the parent to the child by 
- * fork() is not used. This is particularly inefficient in a paged environment, 
- * making vfork() particularly useful. Depending upon the size of the parent's 
- * data space, vfork() can give a significant performance improvement over 
- * fork().
+ * Here the child runs using the parent's page directory, so nothing at all is
+ * copied. To stop the two processes from trampling on each other's stack, the
+ * parent is suspended until the child calls execve, which gives it an address
+ * space of its own, or exits. At that point vfork_release completes the
+ * parent's vfork call, which returns the process id of the child.
  * 
- * The vfork() function can normally be used just like fork(). It does not work,
- * however, to return while running in the child's context from the caller of 
- * vfork() since the eventual return from vfork() would then return to a no 
- * longer existent stack frame. Be careful, also, to call _exit() rather than 
- * exit() if you cannot exec, since exit() flushes and closes standard I/O 
- * channels, thereby damaging the parent process' standard I/O data structures. 
+ * It does not work to return while running in the child's context from the
+ * caller of vfork(), since the eventual return from vfork() would then return
+ * to a no longer existent stack frame. Be careful, also, to call _exit() rather
+ * than exit() if you cannot exec, since exit() flushes and closes standard I/O
+ * channels, thereby damaging the parent process' standard I/O data structures.
  * (Even with fork(), it is wrong to call exit(), since buffered data would then
  * be flushed twice.)
- * 
  */
-
 pid_t syscall_vfork(regs * r)
 {
 	/*
@@ -205,49 +152,18 @@ pid_t syscall_vfork(regs * r)
 	child->pid = child_pid;
 	child->parent_pid = parent->pid;
 	child->exists = 1;
-
-	parent->waiting_on = -1;
-
-	/*
-	 * Create a page directory for the new process, and set the segment ranges.
-	 * Note that we have to temporarily disable paging here, because we need to
-	 * deal with physical memory when allocating a page directory and setting up
-	 * the mappings. 
-	 */
-	disable_paging();
-	child->pdir = (page_dir) alloc_page();
-
-	child->text_start = parent->text_start;
-	child->text_end = parent->text_end;
-	child->data_start = parent->data_start;
-	child->data_end = parent->data_end;
-	child->stack_start = parent->stack_start;
-	child->stack_end = parent->stack_end;
-
-	/*
-	 * Identity map memory 0-6Mb 
-	 */
-	unsigned int addr;
-	for (addr = 0 * MB; addr < 6 * MB; addr += PAGE_SIZE)
-		map_page(child->pdir, addr, addr, PAGE_USER, PAGE_READ_ONLY);
+	child->waiting_on = -1;
 
 	/*
-	 * Copy parent's text, data, and stack segments to child 
+	 * Borrow the parent's address space 
 	 */
-	map_and_copy(parent->pdir, child->pdir, child->text_start,
-		     child->text_end);
-	map_and_copy(parent->pdir, child->pdir, child->data_start,
-		     child->data_end);
-	map_and_copy(parent->pdir, child->pdir, child->stack_start,
-		     child->stack_end);
-
-	enable_paging(current_process->pdir);
+	child->pdir = parent->pdir;
+	child->vmas = parent->vmas;
+	child->vfork_parent = parent;
+	parent->vfork_child = child;
 
 	/*
-	 * Copy file handles. The reference count is increased on each of them, so
-	 * that we can keep track of how many file descriptors refere to each file
-	 * handle. This information is needed so we know when to destroy a file handle
-	 * (i.e. when its reference count reaches 0). 
+	 * Copy file handles, as for fork 
 	 */
 	int i;
 	for (i = 0; i < MAX_FDS; i++) {
@@ -256,42 +172,47 @@ pid_t syscall_vfork(regs * r)
 			child->filedesc[i]->refcount++;
 		}
 	}
+	memmove(child->cwd, parent->cwd, PATH_MAX);
+
 	/*
-	 * Copy the saved CPU registers of the current process, which determines its
-	 * execution state (instruction pointer, stack pointer etc.) 
+	 * The child carries on from the same point as the parent, but sees a
+	 * return value of 0 
 	 */
 	child->saved_regs = *r;
 	child->saved_regs.eax = 0;	/* child's return value from vfork */
-
-	//memmove(child->cwd, parent->cwd, PATH_MAX);
+	child->nice = parent->nice;
+	ready_process(child);
 
 	/*
-	 * Place the process on the ready list, so that it can begin execution on a
-	 * subsequent context switch 
+	 * Block the parent until the child releases its address space 
 	 */
-	child->ready = 1;
-	list_add(&ready, child);
+	suspend_process(parent);
+	return -ESUSPEND;
+}
 
-	/*
-	 * Return the child's process id... note that this value will only go to the
-	 * parent, since we set the child's return value from fork above 
-	 */
+/*
+ * vfork_detach
+ * 
+ * Give a process created by vfork an address space of its own, consisting of
+ * just a demand-zero stack, and hand the borrowed one back to its parent. This is
+ * called by execve before the new program is loaded, since otherwise it would
+ * replace the parent's program. The new page directory is switched to before
+ * returning. Returns -ENOMEM if there was not enough memory, in which case the
+ * process is left borrowing its parent's address space.
+ */
+static int vfork_detach(process * proc)
+{
+	page_dir pdir = new_page_dir();
+	if (NULL == pdir)
+		return -ENOMEM;
 
-	kprintf("vfork debug output\n");
-	kprintf("child->pid: %i,%i\n", child->pid, parent->pid);
-	kprintf("exists: %i,%i\n", child->exists, parent->exists);
-	kprintf("ready: %i,%i\n", child->ready, parent->ready);
-	kprintf("pdir: %i,%i\n", child->pdir, parent->pdir);
-	kprintf("last_errno:%i,%i\n", child->last_errno, parent->last_errno);
-	kprintf("stack_start: %u,%u\n", child->stack_start,
-		parent->stack_start);
-	kprintf("stack_end: %u,%u\n", child->stack_end, parent->stack_end);
-	kprintf("data_start: %u,%u\n", child->data_start, parent->data_start);
-	kprintf("data_end: %u,%u\n", child->data_end, parent->data_end);
-	kprintf("text_start: %u,%u\n", child->text_start, parent->text_start);
-	kprintf("text_end: %u,%u\n", child->text_end, parent->text_end);
+	vfork_release(proc);
 
-	return child_pid;
+	proc->pdir = pdir;
+	vma_add(proc, PROCESS_STACK_BASE - PROCESS_STACK_SIZE,
+		PROCESS_STACK_BASE, PROT_READ | PROT_WRITE, VMA_STACK);
+	enable_paging(proc->pdir);
+	return 0;
 }
 
 /*
@@ -299,10 +220,10 @@ pid_t syscall_vfork(regs * r)
  * 
  * Implements the execve system call. This effectively does a "brain transplant"
  * on a process by arranging for it to run a different program to what it was
- * previously. This is achieved by loading the new program from the file system,
- * placing a copy in the process's text segment, and changing the instruction
- * pointer of the process to point to the first instruction of the loaded
- * executable file.
+ * previously. This is achieved by setting up the process's text segment to be
+ * backed by the new program's executable file, from which pages are read in on
+ * demand, and changing the instruction pointer of the process to point to the
+ * first instruction of the loaded executable file.
  * 
  * In addition to loading a new program, this call is also responsible for passing
  * command line arguments to the new program. This is done by using the memory
@@ -321,18 +242,21 @@ syscall_execve(const char *filename, char *const argv[],
 	 * Verify that the filename and all of the pointers within argc arg valid
 	 * (i.e. completely reside in the process's address space) 
 	 */
-	if (!valid_string(filename))
-		return -EFAULT;
+	int res = valid_string(filename);
+	if (0 != res)
+		return res;
 
 	unsigned int argno = 0;
 	if (NULL != argv) {
 		while (1) {
-			if (!valid_pointer(argv, (argno + 1) * sizeof(char *)))
-				return -EFAULT;
+			res = valid_pointer(argv, (argno + 1) * sizeof(char *));
+			if (0 != res)
+				return res;
 			if (NULL == argv[argno])
 				break;
-			if (!valid_string(argv[argno]))
-				return -EFAULT;
+			res = valid_string(argv[argno]);
+			if (0 != res)
+				return res;
 			argno++;
 		}
 	}
@@ -342,7 +266,6 @@ syscall_execve(const char *filename, char *const argv[],
 	 * location within the file system 
 	 */
 	directory_entry *entry;
-	int res;
 	if (0 > (res = get_directory_entry(filesystem, filename, &entry)))
 		return res;
 	if (TYPE_DIR == entry->type)
@@ -388,39 +311,38 @@ syscall_execve(const char *filename, char *const argv[],
 	*(unsigned int *)(argdata + 4) = PROCESS_STACK_BASE - argdata_size + 8;
 
 	/*
-	 * Unmap the existing text segment 
+	 * If we were created by vfork, the address space belongs to our parent, and
+	 * must not be touched. Switch to a new one before loading the program. 
 	 */
-	disable_paging();
-	unsigned int addr;
-	for (addr = proc->text_start; addr < proc->text_end; addr += PAGE_SIZE)
-		unmap_and_free_page(proc->pdir, addr);
-	for (addr = proc->data_start; addr < proc->data_end; addr += PAGE_SIZE)
-		unmap_and_free_page(proc->pdir, addr);
+	if (NULL != proc->vfork_parent) {
+		if (0 != (res = vfork_detach(proc))) {
+			kfree(argdata);
+			return res;
+		}
+	}
 
 	/*
-	 * Resize text and data segments to 0 bytes each 
+	 * Release everything in the address space apart from the stack, i.e. the
+	 * old text and data segments and any mappings made with mmap, and start
+	 * again with an empty data segment 
 	 */
-	proc->text_start = PROCESS_TEXT_BASE;
-	proc->text_end = PROCESS_TEXT_BASE;
-	proc->data_start = PROCESS_DATA_BASE;
-	proc->data_end = PROCESS_DATA_BASE;
+	vma_clear(proc, 1);
+	vma_add(proc, PROCESS_DATA_BASE, PROCESS_DATA_BASE,
+		PROT_READ | PROT_WRITE, VMA_DATA);
 
 	/*
-	 * Load in the text segment from the executable file 
+	 * Set up the text segment to cover the executable file. Nothing is read in
+	 * yet; each page is copied from the file system the first time the program
+	 * touches it (see resolve_page_fault in interrupts.c), so only the parts of
+	 * the program that actually run cost any time or memory. Pages are shared
+	 * with any other processes running the same program. Flat binaries keep
+	 * their data in the same segment as their code, so it is writable. 
 	 */
-	char *data = filesystem + entry->location;
-	for (pos = 0; pos < entry->size; pos += PAGE_SIZE) {
-		proc->text_end = proc->text_start + pos;
-		void *page = alloc_page();
-		if (PAGE_SIZE <= entry->size - pos)
-			memmove(page, &data[pos], PAGE_SIZE);
-		else
-			memmove(page, &data[pos], entry->size - pos);
-		map_page(proc->pdir, proc->text_end, (unsigned int)page,
-			 PAGE_USER, PAGE_READ_WRITE);
-	}
-	proc->text_end = proc->text_start + pos;
-	enable_paging(current_process->pdir);
+	vm_area *text = vma_add(proc, PROCESS_TEXT_BASE, PROCESS_TEXT_BASE +
+				((entry->size + PAGE_SIZE - 1) &
+				 PAGE_ADDRESS_MASK),
+				PROT_READ | PROT_WRITE | PROT_EXEC, VMA_TEXT);
+	text->cache = pagecache_get(entry);
 
 	/*
 	 * Copy the command line argument data we set up above to the process's
@@ -435,7 +357,7 @@ syscall_execve(const char *filename, char *const argv[],
 	 * execution, it will start from the beginning of the loaded code. 
 	 */
 	init_regs(r, PROCESS_STACK_BASE - argdata_size,
-		  (void *)current_process->text_start);
+		  (void *)PROCESS_TEXT_BASE);
 
 	return 0;
 }
@@ -0,0 +1,261 @@
+/*
+ *      vmalloc.c
+ *
+ *      Copyright 2011 Dustin Dorroh <dustindorroh@gmail.com>
+ */
+
+#include <kernel.h>
+
+/*
+ * Virtually contiguous kernel memory
+ *
+ * Large kernel buffers are built from individual pages obtained from the page
+ * allocator, which are mapped next to each other in a region of the kernel's
+ * address space starting at VMALLOC_BASE. This avoids using up the limited
+ * buddy heap, and does not require physically contiguous memory.
+ *
+ * The page tables covering the region are allocated once at boot time from the
+ * buddy heap, and installed in kernel_pdir, so every page directory shares them
+ * and sees the same mappings.
+ *
+ * Each allocation is followed by an unmapped guard page, so that overrunning the
+ * end of a buffer causes a page fault instead of silently corrupting the next
+ * one. The page table entry for the guard page holds VMALLOC_GUARD, which also
+ * marks where the allocation ends. Free entries are zero.
+ */
+
+#define VMALLOC_PAGES     (VMALLOC_SIZE / PAGE_SIZE)
+#define VMALLOC_GUARD     0x800
+
+#define vmalloc_index(_p) (((unsigned int)(_p) - VMALLOC_BASE) / PAGE_SIZE)
+#define vmalloc_addr(_i)  (VMALLOC_BASE + (_i) * PAGE_SIZE)
+
+/*
+ * Page table entries for the whole region, one page table after another
+ */
+static page_table vmalloc_ptes = NULL;
+
+/*
+ * vmalloc_init
+ *
+ * Allocate the page tables for the vmalloc region and install them in
+ * kernel_pdir. This must be called after page_init, and before any processes
+ * are started, so that all page directories get a copy of the entries.
+ */
+void vmalloc_init(void)
+{
+	unsigned int ntables = VMALLOC_PAGES / 1024;
+	unsigned int i;
+
+	vmalloc_ptes = (page_table) kmalloc_low(ntables * PAGE_SIZE);
+	assert(0 == (unsigned int)vmalloc_ptes % PAGE_SIZE);
+	memset(vmalloc_ptes, 0, ntables * PAGE_SIZE);
+
+	page_dir kdir = (page_dir) phys_to_virt(kernel_pdir);
+	for (i = 0; i < ntables; i++)
+		kdir[VMALLOC_BASE / (4 * MB) + i] =
+		    virt_to_phys(&vmalloc_ptes[i * 1024]) | PAGE_PRESENT |
+		    PAGE_SUPERVISOR | PAGE_READ_WRITE;
+}
+
+/*
+ * vmalloc_unmap
+ *
+ * Unmap the pages in the specified range of the region, and return them to the
+ * page allocator
+ */
+static void vmalloc_unmap(unsigned int first, unsigned int end)
+{
+	unsigned int i;
+	for (i = first; i < end; i++) {
+		assert(vmalloc_ptes[i] & PAGE_PRESENT);
+		free_page((void *)(vmalloc_ptes[i] & PAGE_ADDRESS_MASK));
+		vmalloc_ptes[i] = 0;
+		invalidate_page(vmalloc_addr(i));
+	}
+}
+
+/*
+ * vmalloc_map
+ *
+ * Map n newly allocated pages into the region, starting at the specified index.
+ * If there is not enough memory, the pages mapped so far are released again, and
+ * -ENOMEM is returned.
+ */
+static int vmalloc_map(unsigned int first, unsigned int n)
+{
+	unsigned int i;
+	for (i = first; i < first + n; i++) {
+		void *page = alloc_page();
+		if (NULL == page) {
+			vmalloc_unmap(first, i);
+			return -ENOMEM;
+		}
+		vmalloc_ptes[i] = (unsigned int)page | PAGE_PRESENT |
+		    PAGE_SUPERVISOR | PAGE_READ_WRITE;
+	}
+	return 0;
+}
+
+/*
+ * vmalloc_npages
+ *
+ * Count the number of pages in an allocation, by looking for its guard page
+ */
+static unsigned int vmalloc_npages(unsigned int first)
+{
+	unsigned int i = first;
+	while (VMALLOC_GUARD != vmalloc_ptes[i])
+		i++;
+	return i - first;
+}
+
+/*
+ * vmalloc_is_free
+ *
+ * Check whether every entry in the specified range of the region is unused
+ */
+static int vmalloc_is_free(unsigned int first, unsigned int end)
+{
+	unsigned int i;
+	if (end > VMALLOC_PAGES)
+		return 0;
+	for (i = first; i < end; i++) {
+		if (0 != vmalloc_ptes[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * vmalloc_aligned
+ *
+ * Allocate a virtually contiguous buffer of at least nbytes bytes, whose address
+ * is a multiple of align, which must be a power of two no smaller than
+ * PAGE_SIZE. Returns NULL if there is not enough memory or address space
+ * available.
+ */
+void *vmalloc_aligned(unsigned int nbytes, unsigned int align)
+{
+	unsigned int npages = (nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+	unsigned int step = align / PAGE_SIZE;
+	unsigned int run = 0;
+	unsigned int i;
+	assert(0 == align % PAGE_SIZE);
+	if (0 == npages)
+		npages = 1;
+
+	/*
+	 * Find a large enough run of free entries, including one for the guard
+	 * page. A run may only begin at a suitably aligned entry. 
+	 */
+	for (i = 0; (i < VMALLOC_PAGES) && (run < npages + 1); i++) {
+		if (0 != vmalloc_ptes[i])
+			run = 0;
+		else if ((0 != run) || (0 == i % step))
+			run++;
+	}
+	if (run < npages + 1) {
+		kprintf("vmalloc: out of address space\n");
+		return NULL;
+	}
+
+	unsigned int first = i - run;
+
+	if (0 != vmalloc_map(first, npages))
+		return NULL;
+	vmalloc_ptes[first + npages] = VMALLOC_GUARD;
+	return (void *)vmalloc_addr(first);
+}
+
+/*
+ * vmalloc
+ *
+ * Allocate a virtually contiguous, page aligned buffer of at least nbytes bytes
+ */
+void *vmalloc(unsigned int nbytes)
+{
+	return vmalloc_aligned(nbytes, PAGE_SIZE);
+}
+
+/*
+ * vmalloc_size
+ *
+ * Return the size of a buffer allocated by vmalloc
+ */
+unsigned int vmalloc_size(void *ptr)
+{
+	return vmalloc_npages(vmalloc_index(ptr)) * PAGE_SIZE;
+}
+
+/*
+ * vrealloc
+ *
+ * Change the size of a buffer allocated by vmalloc. Shrinking just unmaps pages
+ * from the end. Growing is done in place if the address space following the
+ * buffer is free; otherwise a new buffer is allocated and the contents copied.
+ * Returns NULL if there is not enough memory, leaving the original buffer
+ * untouched.
+ */
+void *vrealloc(void *ptr, unsigned int nbytes)
+{
+	if (NULL == ptr)
+		return vmalloc(nbytes);
+
+	if (0 == nbytes) {
+		vfree(ptr);
+		return NULL;
+	}
+
+	unsigned int first = vmalloc_index(ptr);
+	unsigned int oldpages = vmalloc_npages(first);
+	unsigned int newpages = (nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if (newpages <= oldpages) {
+		vmalloc_ptes[first + oldpages] = 0;
+		vmalloc_unmap(first + newpages, first + oldpages);
+		vmalloc_ptes[first + newpages] = VMALLOC_GUARD;
+		return ptr;
+	}
+
+	/*
+	 * The old guard page becomes part of the buffer, so only the entries after
+	 * it need to be free
+	 */
+	if (vmalloc_is_free(first + oldpages + 1, first + newpages + 1)) {
+		vmalloc_ptes[first + oldpages] = 0;
+		if (0 != vmalloc_map(first + oldpages, newpages - oldpages)) {
+			vmalloc_ptes[first + oldpages] = VMALLOC_GUARD;
+			return NULL;
+		}
+		vmalloc_ptes[first + newpages] = VMALLOC_GUARD;
+		return ptr;
+	}
+
+	void *newptr = vmalloc(nbytes);
+	if (NULL == newptr)
+		return NULL;
+	memmove(newptr, ptr, oldpages * PAGE_SIZE);
+	vfree(ptr);
+	return newptr;
+}
+
+/*
+ * vfree
+ *
+ * Release a buffer allocated by vmalloc, returning its pages to the page
+ * allocator
+ */
+void vfree(void *ptr)
+{
+	if (NULL == ptr)
+		return;
+
+	assert(is_vmalloc_addr(ptr));
+	assert(0 == (unsigned int)ptr % PAGE_SIZE);
+
+	unsigned int first = vmalloc_index(ptr);
+	unsigned int npages = vmalloc_npages(first);
+	vmalloc_unmap(first, first + npages);
+	vmalloc_ptes[first + npages] = 0;
+}